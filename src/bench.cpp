@@ -0,0 +1,587 @@
+// Benchmarks for the histogram builders, the window queries and the filter,
+// run on synthetic images.  Each measurement is printed as one line of comma
+// separated values, after a header line, so that results can be collected
+// and compared over time.  Throughput is in millions of image pixels per
+// second, whatever the channel count.  Allocations are counted by replacing
+// the global operator new, so only memory allocated with new is included.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <new>
+
+#include "filter.h"
+#include "image.h"
+
+#include "settings.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// Allocation counting.  Each block carries its size in front of it so that
+// the live total can be kept up to date on delete.
+
+static size_t g_allocated(0), g_live(0), g_peak(0);
+
+static void *counted_alloc(size_t size)
+{
+    const size_t header = 16;
+    size_t *block = (size_t *)malloc(size + header);
+    size_t live;
+
+    if(!block)
+    {
+        throw std::bad_alloc();
+    }
+    block[0] = size;
+
+    __sync_fetch_and_add(&g_allocated, size);
+    live = __sync_add_and_fetch(&g_live, size);
+    for(;;)
+    {
+        size_t peak = g_peak;
+
+        if((live <= peak) || __sync_bool_compare_and_swap(&g_peak, peak, live))
+        {
+            break;
+        }
+    }
+    return (char *)block + header;
+}
+
+static void counted_free(void *p)
+{
+    const size_t header = 16;
+
+    if(p)
+    {
+        size_t *block = (size_t *)((char *)p - header);
+        __sync_fetch_and_sub(&g_live, block[0]);
+        free(block);
+    }
+}
+
+void *operator new(size_t size)
+{
+    return counted_alloc(size);
+}
+void *operator new[](size_t size)
+{
+    return counted_alloc(size);
+}
+void operator delete(void *p) throw()
+{
+    counted_free(p);
+}
+void operator delete[](void *p) throw()
+{
+    counted_free(p);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Side of the square the refilter benchmark fills, about what the plug-in's
+// preview shows.
+static const uint32_t PREVIEW_SIZE = 512;
+
+typedef struct _bench_case
+{
+    uint32_t width, height, channels, radius, bins;
+    uint32_t tile_size, threads;
+    filter_engine engine;
+} bench_case;
+
+typedef struct _bench_result
+{
+    double seconds;
+    size_t allocated, peak;
+} bench_result;
+
+static double now(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + (t.tv_nsec * 1e-9);
+}
+
+// Histogram buffers kept from earlier cases are handed back first, so that
+// what a case allocates does not depend on what ran before it.
+static void start_measurement(bench_result &result, double &start)
+{
+    spectral::drain_histogram_allocator();
+    g_allocated = 0;
+    g_peak = g_live;
+    result.peak = g_live;
+    start = now();
+}
+
+static void end_measurement(bench_result &result, double start)
+{
+    result.seconds = now() - start;
+    result.allocated = g_allocated;
+    result.peak = g_peak - result.peak;
+}
+
+static void print_result(const char *name, const bench_case &c,
+                         const bench_result &r)
+{
+    double mpix = ((double)c.width * c.height) / 1e6;
+
+    printf("%s,%u,%u,%u,%u,%u,%s,%u,%.6f,%.3f,%lu,%lu\n",
+           name, c.width, c.height, c.channels, c.radius, c.bins,
+           filter_engine_name(c.engine), c.threads, r.seconds,
+           (r.seconds > 0) ? (mpix / r.seconds) : 0.0,
+           (unsigned long)r.allocated, (unsigned long)r.peak);
+    fflush(stdout);
+}
+
+// Smooth gradients with noise and a few hard edges, so that windows see a
+// spread of values and the threshold matters.
+static spectral::Image *make_image(uint32_t width, uint32_t height,
+                                   uint32_t channels)
+{
+    spectral::Image *result = new spectral::Image(width, height, channels);
+    uint8_t *out = result->get_buffer();
+    uint32_t seed(12345);
+
+    for(uint32_t y=0; y<height; y++)
+    {
+        for(uint32_t x=0; x<width; x++)
+        {
+            for(uint32_t c=0; c<channels; c++)
+            {
+                int32_t value = ((x * 3) + (y * 2) + (c * 40)) & 255;
+
+                if(((x / 50) + (y / 70)) & 1)
+                {
+                    value = 255 - value;
+                }
+                seed = (seed * 1103515245) + 12345;
+                value+= int32_t((seed >> 16) % 20) - 10;
+                *out++ = (value < 0) ? 0 : ((value > 255) ? 255 : value);
+            }
+        }
+    }
+    return result;
+}
+
+// Build integral histograms over the tiles the integral engine would use,
+// and optionally query every window in them.
+template <typename T, uint32_t BINS>
+static void bench_tiles(const spectral::Image &img, const bench_case &c,
+                        uint32_t tile_width, uint32_t tile_height,
+                        bool query, bench_result &result)
+{
+    uint32_t hist_width = tile_width + (c.radius * 2);
+    uint32_t hist_height = tile_height + (c.radius * 2);
+    uint32_t width = img.get_width() + (c.radius * 2);
+    uint32_t height = img.get_height() + (c.radius * 2);
+    uint32_t bins[BINS], checksum(0);
+    double start;
+
+    start_measurement(result, start);
+    {
+        spectral::integral_histogram<T, BINS> hist(hist_width, hist_height);
+
+        for(uint32_t y=0; y<img.get_height(); y+= tile_height)
+        {
+            for(uint32_t x=0; x<img.get_width(); x+= tile_width)
+            {
+                uint32_t w = ((x + hist_width) > width) ? (width - x) : hist_width;
+                uint32_t h = ((y + hist_height) > height) ? (height - y) : hist_height;
+
+                for(uint32_t ch=0; ch<c.channels; ch++)
+                {
+                    hist.Rebuild(img, int32_t(x) - int32_t(c.radius),
+                                 int32_t(y) - int32_t(c.radius), w, h, ch);
+
+                    // As the filter does, with the fast path.
+                    if(query)
+                    {
+                        uint32_t window = (c.radius * 2) + 1;
+
+                        for(uint32_t yy=0; (yy + window) <= h; yy++)
+                        {
+                            const T *top, *bottom;
+
+                            hist.GetRows(yy, window, top, bottom);
+                            for(uint32_t xx=0; (xx + window) <= w; xx++)
+                            {
+                                hist.GetWindow(top, bottom, window, bins);
+                                top+= BINS;
+                                bottom+= BINS;
+                                checksum+= bins[xx % BINS];
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+    end_measurement(result, start);
+
+    if(checksum == 1)
+    {
+        // Never true in practice; keeps the queries from being optimised out.
+        fprintf(stderr, "checksum %u\n", checksum);
+    }
+}
+
+template <uint32_t BINS>
+static void bench_tiles(const spectral::Image &img, const bench_case &c,
+                        uint32_t tile_width, uint32_t tile_height,
+                        bool query, bench_result &result)
+{
+    uint32_t window = (c.radius * 2) + 1;
+
+    if((window * window) <= spectral::integral_histogram<uint16_t, BINS>::max_window_area())
+    {
+        bench_tiles<uint16_t, BINS>(img, c, tile_width, tile_height, query, result);
+    }
+    else
+    {
+        bench_tiles<uint32_t, BINS>(img, c, tile_width, tile_height, query, result);
+    }
+}
+
+// Returns false for bin counts that have no histogram instance, and where
+// the window does not fit in a tile.
+static bool bench_tiles(const spectral::Image &img, const bench_case &c,
+                        bool query, bench_result &result)
+{
+    uint32_t tile_width, tile_height;
+
+    if(!get_tile_geometry(img.get_width(), img.get_height(), c.channels,
+                          c.radius, c.bins, c.tile_size, c.threads, true,
+                          tile_width, tile_height))
+    {
+        return false;
+    }
+
+    switch(c.bins)
+    {
+    case 8:
+        bench_tiles<8>(img, c, tile_width, tile_height, query, result);
+        break;
+    case 16:
+        bench_tiles<16>(img, c, tile_width, tile_height, query, result);
+        break;
+    case 32:
+        bench_tiles<32>(img, c, tile_width, tile_height, query, result);
+        break;
+    case 64:
+        bench_tiles<64>(img, c, tile_width, tile_height, query, result);
+        break;
+    case 128:
+        bench_tiles<128>(img, c, tile_width, tile_height, query, result);
+        break;
+    case 256:
+        bench_tiles<256>(img, c, tile_width, tile_height, query, result);
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static const char *bench_names[] =
+{
+    "build", "query", "filter", "refilter", "joint", NULL
+};
+
+// Parse a comma separated list of numbers.
+static uint32_t parse_list(const char *arg, double *values, uint32_t max)
+{
+    uint32_t count(0);
+
+    while(*arg && (count < max))
+    {
+        char *end;
+        double value = strtod(arg, &end);
+
+        if(end == arg)
+        {
+            break;
+        }
+        values[count++] = value;
+        arg = (*end == ',') ? (end + 1) : end;
+    }
+    return count;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -s sizes       image sizes in megapixels (default 1,10,100)\n"
+            "  -r radii       filter radii (default 1,10,100)\n"
+            "  -b bins        bin counts (default 16,64,256)\n"
+            "  -c channels    channel counts (default 1,3)\n"
+            "  -e engines     filter engines, e.g. auto,sliding (default auto)\n"
+            "  -j threads     worker threads, 0 for one per cpu (default 0)\n"
+            "  -t size        integral histogram tile size, 0 to size tiles\n"
+            "                 from memory (default %d)\n"
+            "  -x benchmarks  some of build,query,filter,refilter,joint\n"
+            "                 (default all)\n"
+            "  -n repeats     report the best of n runs (default 1)\n"
+            "Lists are comma separated.\n",
+            name, DEFAULT_TILE_SIZE);
+}
+
+int main(int argc, char **argv)
+{
+    double sizes[16] = { 1, 10, 100 }, radii[16] = { 1, 10, 100 };
+    double bin_counts[16] = { 16, 64, 256 }, channel_counts[16] = { 1, 3 };
+    uint32_t num_sizes(3), num_radii(3), num_bin_counts(3), num_channel_counts(2);
+    filter_engine engines[4] = { FILTER_ENGINE_AUTO };
+    uint32_t num_engines(1);
+    bool run[5] = { true, true, true, true, true };
+    uint32_t threads(0), tile_size(DEFAULT_TILE_SIZE), repeats(1);
+    int opt;
+
+    while((opt = getopt(argc, argv, "s:r:b:c:e:j:t:x:n:")) != -1)
+    {
+        switch(opt)
+        {
+        case 's':
+            num_sizes = parse_list(optarg, sizes, 16);
+            break;
+        case 'r':
+            num_radii = parse_list(optarg, radii, 16);
+            break;
+        case 'b':
+            num_bin_counts = parse_list(optarg, bin_counts, 16);
+            break;
+        case 'c':
+            num_channel_counts = parse_list(optarg, channel_counts, 16);
+            break;
+        case 'e':
+            num_engines = 0;
+            for(const char *name = strtok(optarg, ","); name && (num_engines < 4);
+                    name = strtok(NULL, ","))
+            {
+                for(uint32_t i=0; i<4; i++)
+                {
+                    if(!strcmp(name, filter_engine_name((filter_engine)i)))
+                    {
+                        engines[num_engines++] = (filter_engine)i;
+                    }
+                }
+            }
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        case 't':
+            tile_size = atoi(optarg);
+            break;
+        case 'x':
+            for(uint32_t i=0; bench_names[i]; i++)
+            {
+                run[i] = strstr(optarg, bench_names[i]) != NULL;
+            }
+            break;
+        case 'n':
+            repeats = atoi(optarg) ? atoi(optarg) : 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    printf("benchmark,width,height,channels,radius,bins,engine,threads,"
+           "seconds,mpix_per_s,bytes_allocated,peak_bytes\n");
+
+    for(uint32_t si=0; si<num_sizes; si++)
+    {
+        // 4:3 images of the requested size.
+        double pixels = sizes[si] * 1e6;
+        uint32_t width = uint32_t(sqrt(pixels * 4.0 / 3.0));
+        uint32_t height = width ? uint32_t(pixels / width) : 0;
+
+        if(!width || !height)
+        {
+            continue;
+        }
+
+        for(uint32_t ci=0; ci<num_channel_counts; ci++)
+        {
+            uint32_t channels = uint32_t(channel_counts[ci]);
+            spectral::Image *img = make_image(width, height, channels);
+            spectral::Image *dest = new spectral::Image(width, height, channels);
+
+            for(uint32_t ri=0; ri<num_radii; ri++)
+            {
+                bench_case c;
+
+                c.width = width;
+                c.height = height;
+                c.channels = channels;
+                c.radius = uint32_t(radii[ri]);
+                c.tile_size = tile_size;
+                c.threads = 1;
+                c.engine = FILTER_ENGINE_INTEGRAL;
+                c.bins = 0;
+
+                for(uint32_t bi=0; bi<num_bin_counts; bi++)
+                {
+                    c.bins = uint32_t(bin_counts[bi]);
+                    c.engine = FILTER_ENGINE_INTEGRAL;
+                    c.threads = 1;
+
+                    // Histogram kernels, on a single thread and only where
+                    // the window fits in a tile.
+                    for(uint32_t k=0; k<2; k++)
+                    {
+                        bench_result best;
+                        bool ok(true);
+
+                        if(!run[k])
+                        {
+                            continue;
+                        }
+                        for(uint32_t n=0; (n<repeats) && ok; n++)
+                        {
+                            bench_result r;
+
+                            ok = bench_tiles(*img, c, k == 1, r);
+                            if(!n || (r.seconds < best.seconds))
+                            {
+                                best = r;
+                            }
+                        }
+                        if(ok)
+                        {
+                            print_result(bench_names[k], c, best);
+                        }
+                    }
+
+                    // The whole filter.
+                    for(uint32_t ei=0; run[2] && (ei<num_engines); ei++)
+                    {
+                        bench_result best;
+
+                        c.engine = engines[ei];
+                        c.threads = threads;
+
+                        for(uint32_t n=0; n<repeats; n++)
+                        {
+                            bench_result r;
+                            double start;
+
+                            start_measurement(r, start);
+                            filter_image_with_bins(c.bins, img, NULL, 0, 0,
+                                                   c.radius, 30, false,
+                                                   tile_size, threads, c.engine,
+                                                   FILTER_GUIDE_NONE, FILTER_ALPHA_FILTER,
+                                                   NULL, NULL, NULL, dest);
+                            end_measurement(r, start);
+
+                            if(!n || (r.seconds < best.seconds))
+                            {
+                                best = r;
+                            }
+                        }
+                        print_result("filter", c, best);
+                    }
+
+                    // The filter again with only the threshold changed, after
+                    // a first run, reported as "preview", has filled the
+                    // histogram cache.  Like the plug-in's preview, both fill
+                    // a PREVIEW_SIZE square from the middle of the image, so
+                    // that the cache can hold it.
+                    for(uint32_t ei=0; run[3] && (ei<num_engines); ei++)
+                    {
+                        spectral::HistogramCache cache(HISTOGRAM_CACHE_BYTES);
+                        cached_source cached = { &cache, 0, 0, 0 };
+                        uint32_t preview_width =
+                            (width < PREVIEW_SIZE) ? width : PREVIEW_SIZE;
+                        uint32_t preview_height =
+                            (height < PREVIEW_SIZE) ? height : PREVIEW_SIZE;
+                        uint32_t x0 = (width - preview_width) / 2;
+                        uint32_t y0 = (height - preview_height) / 2;
+                        spectral::Image preview(preview_width, preview_height,
+                                                channels);
+                        bench_case p(c);
+                        bench_result fill, best;
+                        double fill_start;
+
+                        p.width = preview_width;
+                        p.height = preview_height;
+                        p.engine = engines[ei];
+                        p.threads = threads;
+
+                        start_measurement(fill, fill_start);
+                        filter_image_with_bins(p.bins, img, NULL, x0, y0,
+                                               p.radius, 30, false,
+                                               tile_size, threads, p.engine,
+                                               FILTER_GUIDE_NONE, FILTER_ALPHA_FILTER,
+                                               &cached, NULL, NULL, &preview);
+                        end_measurement(fill, fill_start);
+                        print_result("preview", p, fill);
+
+                        for(uint32_t n=0; n<repeats; n++)
+                        {
+                            bench_result r;
+                            double start;
+
+                            start_measurement(r, start);
+                            filter_image_with_bins(p.bins, img, NULL, x0, y0,
+                                                   p.radius, 31 + n, false,
+                                                   tile_size, threads, p.engine,
+                                                   FILTER_GUIDE_NONE, FILTER_ALPHA_FILTER,
+                                                   &cached, NULL, NULL, &preview);
+                            end_measurement(r, start);
+
+                            if(!n || (r.seconds < best.seconds))
+                            {
+                                best = r;
+                            }
+                        }
+                        print_result("refilter", p, best);
+                    }
+
+                    // The colour channels filtered together, guided by luma,
+                    // to compare with filtering them one at a time.  It
+                    // always runs on the sliding engine.
+                    if(run[4] && (channels >= 3))
+                    {
+                        bench_result best;
+
+                        c.engine = FILTER_ENGINE_SLIDING;
+                        c.threads = threads;
+
+                        for(uint32_t n=0; n<repeats; n++)
+                        {
+                            bench_result r;
+                            double start;
+
+                            start_measurement(r, start);
+                            filter_image_with_bins(c.bins, img, NULL, 0, 0,
+                                                   c.radius, 30, false,
+                                                   tile_size, threads, c.engine,
+                                                   FILTER_GUIDE_LUMA, FILTER_ALPHA_FILTER,
+                                                   NULL, NULL, NULL, dest);
+                            end_measurement(r, start);
+
+                            if(!n || (r.seconds < best.seconds))
+                            {
+                                best = r;
+                            }
+                        }
+                        print_result("joint", c, best);
+                    }
+                }
+            }
+
+            delete dest;
+            delete img;
+        }
+    }
+    return 0;
+}
@@ -3,400 +3,221 @@
 #include <string.h>
 
 #include "bilateral.h"
+#include "filter.h"
 #include "image.h"
+#include "stats.h"
 
 #include "settings.h"
 
-#define FILTER_JOB_SHARE 0.75
-#define ENHANCE_JOB_SHARE 0.25
-// Filter context contains precalculated weights and mean values for various
-// bins and bin/offset combinations.
-typedef struct _filter_context
+// Copy the pixels of a region into a view of the area of the drawable whose
+// top left corner is at (x0, y0).  Each gimp tile is viewed where it lies
+// and copied straight into place.
+void rgn_to_image(GimpPixelRgn &rgn_in, gint x0, gint y0,
+                  const spectral::ImageView &img)
 {
-    uint32_t bin_map[256], offset_map[256];
-    float bin_value[NUM_BINS];
-    float offset_weights[NUM_BINS][BIN_SIZE];
-} filter_context;
+    gpointer iter;
 
-// Integrals of filter weights as a function of distance from centre.
-static float linear_integral_fun(float threshold, float x)
-{
-    float integral = x - ((x * x) / (2.0 * threshold));
-    return integral;
-}
+    for(iter = gimp_pixel_rgns_register(1, &rgn_in);
+        iter != NULL;
+        iter = gimp_pixel_rgns_process(iter))
+    {
+        spectral::ImageView tile(rgn_in.data, rgn_in.w, rgn_in.h,
+                                 img.get_channels(), rgn_in.rowstride);
 
-static float quadratic_integral_fun(float threshold, float x)
-{
-    float integral = x - ((x * x * x) / (3.0 * threshold * threshold));
-    return integral;
+        img.get_view(rgn_in.x - x0, rgn_in.y - y0,
+                     rgn_in.w, rgn_in.h).copy_from(tile);
+    }
 }
 
-// Initialisation of various lookup tables for bin average intensity values,
-// bin weights for various initial offsets etc.
-void initialise_filter_context(uint32_t threshold,
-                               bool quadratic,
-                               filter_context &ctx)
+// The reverse of rgn_to_image.
+void write_image_to_rgn(const spectral::ImageView &img, gint x0, gint y0,
+                        GimpPixelRgn &rgn_out)
 {
-    float (*get_integral)(float, float)(NULL);
-    float ft;
-    ft = float(threshold)/256.0;
+    gpointer iter;
 
-    if(quadratic)
-    {
-        get_integral = quadratic_integral_fun;
-    }
-    else
+    for(iter = gimp_pixel_rgns_register(1, &rgn_out);
+        iter != NULL;
+        iter = gimp_pixel_rgns_process(iter))
     {
-        get_integral = linear_integral_fun;
-    }
+        spectral::ImageView tile(rgn_out.data, rgn_out.w, rgn_out.h,
+                                 img.get_channels(), rgn_out.rowstride);
 
-    for(uint32_t i=0; i<256; i++)
-    {
-        ctx.bin_map[i] = div(i,BIN_SIZE).quot;
-        ctx.offset_map[i] = div(i,BIN_SIZE).rem;
-    }
-
-    for(uint32_t i=0; i<NUM_BINS; i++)
-    {
-        ctx.bin_value[i] = ((i * BIN_SIZE) + ((i+1) * BIN_SIZE))/2.0;
-
-        for(uint32_t j=0; j<BIN_SIZE; j++)
-        {
-            uint32_t near_dist, far_dist;
-
-            near_dist = j + (i * BIN_SIZE);
-            far_dist = near_dist + BIN_SIZE;
-
-            // Spot the edge of the filter kernel.
-            if(far_dist <= threshold)
-            {
-                float near(near_dist), far(far_dist);
-                near/= 256;
-                far/= 256;
-                ctx.offset_weights[i][j] = get_integral(ft, far) - get_integral(ft, near);
-            }
-            else if (near_dist <= threshold)
-            {
-                float near(near_dist), far(threshold);
-                near/= 256;
-                far/= 256;
-                ctx.offset_weights[i][j] = get_integral(ft, far) - get_integral(ft, near);
-            }
-            else
-            {
-                ctx.offset_weights[i][j] = -1;
-            }
-        }
+        tile.copy_from(img.get_view(rgn_out.x - x0, rgn_out.y - y0,
+                                    rgn_out.w, rgn_out.h));
     }
 }
 
-spectral::Image *rgn_to_image(GimpPixelRgn &rgn_in, uint32_t width, uint32_t height, uint32_t channels)
+// The area of a drawable held by a source image.
+typedef struct _drawable_area
 {
-    guchar *row;
-    row = g_new(guchar, channels * width);
-    spectral::Image *result(NULL);
-    {
-        uint32_t index(0), y(0);
+    GimpDrawable *drawable;
+    gint x, y;
+} drawable_area;
 
-        result = new spectral::Image(width, height, channels);
-
-        if(result)
-        {
-            for(y=0; y<height; y++)
-            {
-                gimp_pixel_rgn_get_row(&rgn_in, row, 0, y, width);
-                memcpy((void *)(result->get_buffer()+index), (void *)row, width * channels);
-                index+=(width * channels);
-            }
-        }
-    }
-    g_free(row);
-    return result;
-}
+// Part of the gimp progress bar, onto which the filter's progress is mapped.
+typedef struct _progress_range
+{
+    double min, max;
+} progress_range;
 
-void write_image_to_rgn(spectral::Image *img, GimpPixelRgn &rgn_out)
+static bool update_gimp_progress(void *data, double progress)
 {
-    guchar *row;
-    row = g_new(guchar, img->get_channels() * img->get_width());
-    {
-        uint32_t index(0), y(0);
+    const progress_range *range = (const progress_range *)data;
 
-        if(img)
-        {
-            for(y=0; y<img->get_height(); y++)
-            {
-                memcpy((void *)row, (void *)(img->get_buffer()+index),
-                       img->get_width() * img->get_channels());
-                gimp_pixel_rgn_set_row(&rgn_out, row, 0, y, img->get_width());
-                index+=(img->get_width() * img->get_channels());
-            }
-        }
-    }
-    g_free(row);
+    gimp_progress_update(range->min + (progress * (range->max - range->min)));
+    return true;
 }
 
-void filter_tile(const spectral::IntegralHistogram *hist,
-                 const filter_context &ctx,
-                 uint32_t radius,
-                 uint32_t x_offset,
-                 uint32_t y_offset,
-                 uint32_t width,
-                 uint32_t height,
-                 uint32_t channel,
-                 double min_progress,
-                 double max_progress,
-                 spectral::Image *dest)
+static void read_drawable_rows(void *data, uint32_t y0, uint32_t y1,
+                               spectral::Image *img)
 {
-    uint32_t channels;
+    const drawable_area *area = (const drawable_area *)data;
+    GimpPixelRgn rgn_in;
 
-    channels = dest->get_channels();
+    gimp_pixel_rgn_init(&rgn_in, area->drawable, area->x, area->y + y0,
+                        img->get_width(), y1 - y0, FALSE, FALSE);
+    rgn_to_image(rgn_in, area->x, area->y, *img);
+}
 
-    if((width + x_offset) > dest->get_width())
-    {
-        width = dest->get_width() - x_offset;
-    }
-    if((height + y_offset) > dest->get_height())
-    {
-        height = dest->get_height() - y_offset;
-    }
 
-    if(hist && dest)
+void bilateral_filter(uint32_t radius, uint32_t threshold, uint32_t num_bins,
+                      uint32_t tile_size, uint32_t num_threads,
+                      filter_engine engine, filter_guide guide,
+                      filter_alpha alpha, gboolean use_linear, gint32 image_id,
+                      GimpDrawable *drawable)
+{
+    if(drawable)
     {
-        for(uint32_t y=0; y<height; y++)
+        uint32_t channels;
+        gint32 drawable_id(drawable->drawable_id);
+        spectral::Image *source(NULL), *dest(NULL);
+        source_reader reader;
+        drawable_area area;
+        gint32 tmp;
+        gint x, y, width, height, x1, y1;
+        GimpPixelRgn rgn_out;
+        stats_timer timer;
+
+        // Only the selected part of the drawable is filtered, and only it
+        // and an apron of radius pixels around it are read.  merge_shadow
+        // blends the result through the selection mask.
+        if(!gimp_drawable_mask_intersect(drawable_id, &x, &y, &width, &height))
         {
-            double progress;
-            uint32_t ymax, row_index;
-            uint8_t *row;
-
-            row_index = channel;
-            ymax = y + (radius * 2);// - 1;
-            {
-                uint32_t offset;
-                offset  = (x_offset + ((y + y_offset) * dest->get_width()))*channels;
-                row = dest->get_buffer() + offset;
-            }
-
-            for(uint32_t x=0; x<width; x++)
-            {
-                uint32_t bins[NUM_BINS];
-                uint32_t xmax;
-
-                uint32_t cur_val, cur_bin, offset, value;
-                float total_value, total_weight;
-                xmax = x + (radius * 2);
-
-                // Get a histogram for the sub region.
-
-                hist->GetHistogram(x, y, xmax, ymax, bins);
-
-                cur_val = row[row_index];
-
-                cur_bin = ctx.bin_map[cur_val];
-                offset = ctx.offset_map[cur_val];
-
-                total_weight = BIN_SIZE/256;
-                total_value = total_weight * (float)cur_val;
-
-                // work up.
-                {
-                    uint32_t dir_offset(BIN_SIZE - offset);
-                    uint32_t this_bin(cur_bin);
-                    uint32_t bin_counter(0);
-
-                    while((this_bin < NUM_BINS) &&
-                            (ctx.offset_weights[bin_counter][dir_offset] >= 0))
-                    {
-                        float this_weight, this_value;
-                        this_weight = ctx.offset_weights[bin_counter][dir_offset] * bins[this_bin];
-                        this_value = this_weight * ctx.bin_value[this_bin];
-
-                        total_weight+= this_weight;
-                        total_value+= this_value;
-                        this_bin++;
-                        bin_counter++;
-                    }
-                }
-                // work down.
-                {
-                    uint32_t dir_offset(offset);
-                    uint32_t this_bin(cur_bin);
-                    uint32_t bin_counter(0);
-
-                    while((this_bin < NUM_BINS) &&
-                            (ctx.offset_weights[bin_counter][dir_offset] >= 0))
-                    {
-                        float this_weight, this_value;
-                        this_weight = ctx.offset_weights[bin_counter][dir_offset] * bins[this_bin];
-                        this_value = this_weight * ctx.bin_value[this_bin];
-                        total_weight+= this_weight;
-                        total_value+= this_value;
-                        this_bin--;
-                        bin_counter++;
-                    }
-                }
-
-                if(total_weight > 0)
-                {
-                    value = trunc(total_value/total_weight);
-                    if(value > 255)
-                    {
-                        value = 255;
-                    }
-                }
-                else
-                {
-                    value = 0;
-                }
-                {
-                    uint8_t val = value & 255;
-                    row[row_index] = val;
-                }
-                row_index+= channels;
-            }
-
-            progress = (double)y/(double)height;
-            progress*= (max_progress-min_progress);
-            progress+= min_progress;
-            gimp_progress_update(progress);
+            return;
         }
-    }
-}
+        area.drawable = drawable;
+        area.x = MAX(x - (gint)radius, 0);
+        area.y = MAX(y - (gint)radius, 0);
+        x1 = MIN(x + width + (gint)radius, (gint)drawable->width);
+        y1 = MIN(y + height + (gint)radius, (gint)drawable->height);
 
-void tile_and_filter(const spectral::Image *source,
-                     const filter_context &ctx,
-                     uint32_t tile_size,
-                     uint32_t radius,
-                     uint32_t channel,
-                     double min_progress,
-                     double max_progress,
-                     spectral::Image *dest)
-{
-    uint32_t effective_tile_size;
-    uint32_t x, y;
-    uint32_t num_tiles, tiles_processed;
+        gimp_drawable_get_pixel(drawable_id, 0, 0, &tmp);
+        channels = tmp;
+        gimp_pixel_rgn_init(&rgn_out, drawable, x, y, width, height, TRUE, TRUE);
+        stats_reset();
+
+        // The source is read in bands of gimp tiles as it is filtered.  Where
+        // the apron is cut short by the edge of the drawable the histograms
+        // reflect the edge as they read it, so no bordered copy is needed.
+        source = new spectral::Image(x1 - area.x, y1 - area.y, channels);
+        dest = new spectral::Image(width, height, channels);
+        reader.read_rows = read_drawable_rows;
+        reader.data = &area;
+        reader.band_height = gimp_tile_height();
 
-    effective_tile_size = tile_size - (radius * 2);
-    num_tiles = ((dest->get_width() / effective_tile_size) + 1) *
-                ((dest->get_height() / effective_tile_size) + 1);
-    x = y = tiles_processed = 0;
+        if(source && dest)
+        {
+            progress_range range = { 0.0, 1.0 };
 
-    do
-    {
-        uint32_t next_y;
+            gimp_progress_init("Bilateral Filter");
 
-        next_y = y + effective_tile_size;
+            filter_image_with_bins(num_bins, source, &reader,
+                                   x - area.x, y - area.y, radius, threshold,
+                                   use_linear != FALSE, tile_size, num_threads,
+                                   engine, guide, alpha, NULL,
+                                   update_gimp_progress, &range, dest);
+        }
 
-        if(next_y > dest->get_height())
+        stats_begin(timer);
+        if(dest)
         {
-            next_y = dest->get_height();
+            write_image_to_rgn(*dest, x, y, rgn_out);
         }
+        stats_lap(timer, STATS_WRITE);
+        stats_report("bilateral_filter", width, height, channels, radius, num_bins);
 
-        x = 0;
-        do
+        // clean up.
+        if(source)
         {
-            uint32_t next_x;
-            spectral::IntegralHistogram *hist;
-
-            next_x = x + effective_tile_size;
-
-            if(next_x > dest->get_width())
-            {
-                next_x = dest->get_width();
-            }
-
-            hist = NULL;
-            {
-                uint32_t xmax, ymax;
-                xmax = x + tile_size;
-                ymax = y + tile_size;
-                if(xmax > source->get_width())
-                {
-                    xmax = source->get_width();
-                }
-
-                if(ymax > source->get_height())
-                {
-                    ymax = source->get_height();
-                }
-
-                hist = new spectral::IntegralHistogram(NUM_BINS, *source, x, y,
-                                                       xmax - x,
-                                                       ymax - y,
-                                                       channel);
-            }
-            if(hist)
-            {
-                double min, max;
-                min = tiles_processed;
-                max = tiles_processed + 1;
-                min/= num_tiles;
-                max/= num_tiles;
-                min*= (max_progress - min_progress);
-                max*= (max_progress - min_progress);
-                min+= min_progress;
-                max+= min_progress;
-
-                printf("processing tile at %i,%i\n",x,y);
-                filter_tile(hist, ctx, radius, x, y, next_x - x, next_y - y, channel, min, max, dest);
-                delete hist;
-            }
-
-            tiles_processed++;
-
-            x = next_x;
+            delete source;
+        }
+        if(dest)
+        {
+            delete dest;
         }
-        while(x < dest->get_width());
-        y = next_y;
 
+        // Finish working.
+        gimp_drawable_flush (drawable);
+        gimp_drawable_merge_shadow (drawable_id, TRUE);
+        gimp_drawable_update (drawable_id, x, y, width, height);
     }
-    while(y < dest->get_height());
 }
 
-void bilateral_filter(uint32_t radius, uint32_t threshold, uint32_t tile_size,
-                      gboolean use_linear, gint32 image_id,
-                      GimpDrawable *drawable)
+void bilateral_enhance(uint32_t radius, uint32_t threshold, uint32_t num_bins,
+                       float contrast, uint32_t tile_size, uint32_t num_threads,
+                       filter_engine engine, filter_guide guide,
+                       filter_alpha alpha, gboolean use_linear, gint32 image_id,
+                       GimpDrawable *drawable)
 {
     if(drawable)
     {
         uint32_t width, height, channels;
         gint32 drawable_id(drawable->drawable_id);
         spectral::Image *source(NULL), *dest(NULL);
+        source_reader reader;
+        drawable_area area;
+        stats_timer timer;
         gint32 tmp;
-        GimpPixelRgn rgn_in, rgn_out;
+        GimpPixelRgn rgn_out;
         width = drawable->width;
         height = drawable->height;
 
         gimp_drawable_get_pixel(drawable_id, 0, 0, &tmp);
         channels = tmp;
-        gimp_pixel_rgn_init(&rgn_in, drawable, 0, 0, width, height, FALSE, FALSE);
         gimp_pixel_rgn_init(&rgn_out, drawable, 0, 0, width, height, TRUE, TRUE);
 
-        // Build a source image.
-        dest = rgn_to_image(rgn_in, width, height, channels);
+        stats_reset();
 
-        source = dest->Expand(radius, radius, false, false);
+        // The source is read in bands as it is filtered.  The enhanced result
+        // ends up in dest.
+        source = new spectral::Image(width, height, channels);
+        dest = new spectral::Image(width, height, channels);
+        area.drawable = drawable;
+        area.x = area.y = 0;
+        reader.read_rows = read_drawable_rows;
+        reader.data = &area;
+        reader.band_height = gimp_tile_height();
 
         if(source && dest)
         {
-            filter_context ctx;
+            progress_range range = { 0.0, 1.0 };
 
-            gimp_progress_init("Bilateral Filter");
-            initialise_filter_context(threshold, (use_linear == 0), ctx);
-
-            for(uint32_t i=0; i<channels; i++)
-            {
-                float min_progress, max_progress;
-                min_progress = (double)i/(double)channels;
-                max_progress = (double)(i+1)/(double)channels;
-
-                printf("crunching channel %i\n", i);
+            gimp_progress_init("Enhance Details");
 
-                tile_and_filter(source, ctx, tile_size, radius, i,
-                                min_progress, max_progress, dest);
-            }
+            enhance_image_with_bins(num_bins, source, &reader, 0, 0,
+                                    radius, threshold,
+                                    use_linear != FALSE, tile_size, num_threads,
+                                    engine, guide, alpha, NULL, contrast,
+                                    update_gimp_progress, &range, dest);
         }
 
-        write_image_to_rgn(dest, rgn_out);
+        stats_begin(timer);
+        if(dest)
+        {
+            write_image_to_rgn(*dest, 0, 0, rgn_out);
+        }
+        stats_lap(timer, STATS_WRITE);
+        stats_report("bilateral_enhance", width, height, channels, radius, num_bins);
 
         // clean up.
         if(source)
@@ -415,137 +236,269 @@ void bilateral_filter(uint32_t radius, uint32_t threshold, uint32_t tile_size,
     }
 }
 
-void bilateral_enhance(uint32_t radius, uint32_t threshold, float contrast, uint32_t tile_size,
-                       gboolean use_linear, gint32 image_id,
-                       GimpDrawable *drawable)
+struct _bilateral_preview
 {
-    if(drawable)
-    {
-        uint32_t width, height, channels;
-        gint32 drawable_id(drawable->drawable_id);
-        spectral::Image *source(NULL), *filtered(NULL), *enhanced(NULL);
-        gint32 tmp;
-        GimpPixelRgn rgn_in, rgn_out;
-        width = drawable->width;
-        height = drawable->height;
-
-        gimp_drawable_get_pixel(drawable_id, 0, 0, &tmp);
-        channels = tmp;
-        gimp_pixel_rgn_init(&rgn_in, drawable, 0, 0, width, height, FALSE, FALSE);
-        gimp_pixel_rgn_init(&rgn_out, drawable, 0, 0, width, height, TRUE, TRUE);
-
-        // Build a source image.
-        filtered = rgn_to_image(rgn_in, width, height, channels);
-        enhanced = new spectral::Image(*filtered);
-        source = filtered->Expand(radius, radius, false, false);
-
-        if(source && filtered)
-        {
-            filter_context ctx;
+    GimpDrawable *drawable;
+    gboolean enhance;
+    spectral::HistogramCache *cache;
+    uint32_t generation;
+};
+
+// One render of the preview, which is stale once the preview's generation
+// has moved on.
+typedef struct _preview_render
+{
+    const bilateral_preview *preview;
+    uint32_t generation;
+} preview_render;
 
-            gimp_progress_init("Enhance Details");
-            initialise_filter_context(threshold, (use_linear == 0), ctx);
+static bool preview_is_current(const preview_render &render)
+{
+    return render.generation == render.preview->generation;
+}
 
-            for(uint32_t i=0; i<channels; i++)
-            {
-                float min_progress, max_progress;
-                min_progress = (double)i/(double)channels;
-                max_progress = (double)(i+1)/(double)channels;
+// Keep the dialog responsive while the preview is filtered, and give up as
+// soon as something invalidates it.
+static bool update_preview_progress(void *data, double progress)
+{
+    const preview_render *render = (const preview_render *)data;
 
-                min_progress *= FILTER_JOB_SHARE;
-                max_progress *= FILTER_JOB_SHARE;
-                printf("crunching channel %i\n", i);
+    while(gtk_events_pending() && preview_is_current(*render))
+    {
+        gtk_main_iteration();
+    }
+    return preview_is_current(*render);
+}
 
-                tile_and_filter(source, ctx, tile_size, radius, i,
-                                min_progress, max_progress, filtered);
-            }
-        }
+// Shrink an image by a whole factor, averaging each scale x scale block.
+// Blocks cut short by the right or bottom edge average what they have.
+static spectral::Image *shrink_image(const spectral::Image &img, uint32_t scale)
+{
+    uint32_t width, height, channels, in_width;
+    spectral::Image *result;
+    const uint8_t *in;
+    uint8_t *out;
+
+    channels = img.get_channels();
+    in_width = img.get_width();
+    width = (img.get_width() + scale - 1) / scale;
+    height = (img.get_height() + scale - 1) / scale;
+    result = new spectral::Image(width, height, channels);
+
+    in = img.get_buffer();
+    out = result->get_buffer();
+    for(uint32_t y=0; y<height; y++)
+    {
+        uint32_t y0 = y * scale;
+        uint32_t y1 = MIN(y0 + scale, img.get_height());
 
+        for(uint32_t x=0; x<width; x++)
         {
-            uint8_t *filtered_buf, *enhanced_buf;
-            filtered_buf = filtered->get_buffer();
-            enhanced_buf = enhanced->get_buffer();
-
-            uint32_t size = width * height * channels;
-            float *float_buf = (float *)calloc(size, sizeof(float));
-            float max = 0;
-            for(uint32_t i=0; i<size; i++)
-            {
-                if(i%10000 == 0)
-                {
-                    double progress;
-                    progress = i;
-                    progress/= size;
-                    progress/= 2;
-                    progress *= ENHANCE_JOB_SHARE;
-                    progress+= FILTER_JOB_SHARE;
-                    gimp_progress_update(progress);
-                }
-
-                double filtered_val, enhanced_val, difference;
+            uint32_t x0 = x * scale;
+            uint32_t x1 = MIN(x0 + scale, in_width);
+            uint32_t count = (x1 - x0) * (y1 - y0);
 
-                filtered_val = filtered_buf[i];
-                enhanced_val = enhanced_buf[i];
-
-                difference = enhanced_val - filtered_val;
-                difference *= contrast;
-                enhanced_val+= difference;
-                if(enhanced_val > max)
-                {
-                    max = enhanced_val;
-                }
-                float_buf[i] = enhanced_val;
-            }
-            if(max > 255)
-            {
-                max/= 255;
-            }
-            else
+            for(uint32_t c=0; c<channels; c++)
             {
-                max = 1;
-            }
-            for(uint32_t i=0; i<size; i++)
-            {
-                if(i%10000 == 0)
-                {
-                    double progress;
-                    progress = i;
-                    progress/= size;
-                    progress/= 2;
-                    progress+= 0.5;
-                    progress *= ENHANCE_JOB_SHARE;
-                    progress+= FILTER_JOB_SHARE;
-                    gimp_progress_update(progress);
-                }
+                uint32_t sum(0);
+
+                for(uint32_t yy=y0; yy<y1; yy++)
                 {
-                    int32_t val;
-                    val = trunc(float_buf[i]/max);
-                    if(val > 255) val = 255;
-                    if(val < 0) val = 0;
-                    enhanced_buf[i] = val;
+                    for(uint32_t xx=x0; xx<x1; xx++)
+                    {
+                        sum+= in[(((yy * in_width) + xx) * channels) + c];
+                    }
                 }
+                *out++ = (sum + (count / 2)) / count;
             }
-            free(float_buf);
         }
-        write_image_to_rgn(enhanced, rgn_out);
+    }
+    return result;
+}
 
-        // clean up.
-        if(source)
-        {
-            delete source;
-        }
-        if(filtered)
+// Blow a shrunk image back up to width x height, repeating each pixel.  The
+// first output pixel is x_phase, y_phase pixels into the block of img's top
+// left pixel.
+static spectral::Image *grow_image(const spectral::Image &img, uint32_t scale,
+                                   uint32_t x_phase, uint32_t y_phase,
+                                   uint32_t width, uint32_t height)
+{
+    uint32_t channels(img.get_channels());
+    spectral::Image *result;
+    uint8_t *out;
+
+    result = new spectral::Image(width, height, channels);
+    out = result->get_buffer();
+    for(uint32_t y=0; y<height; y++)
+    {
+        uint32_t yy = MIN((y + y_phase) / scale, img.get_height() - 1);
+        const uint8_t *row = img.get_buffer() + (yy * img.get_width() * channels);
+
+        for(uint32_t x=0; x<width; x++)
         {
-            delete filtered;
+            uint32_t xx = MIN((x + x_phase) / scale, img.get_width() - 1);
+
+            memcpy(out, row + (xx * channels), channels);
+            out+= channels;
         }
-        if(enhanced)
+    }
+    return result;
+}
+
+// Show img, the filtered version of the area of the drawable at (x, y).  It
+// goes through the shadow tiles, as the final result will.
+static void draw_preview(GimpPreview *preview, GimpDrawable *drawable,
+                         gint x, gint y, spectral::Image *img)
+{
+    GimpPixelRgn rgn;
+
+    gimp_pixel_rgn_init(&rgn, drawable, x, y,
+                        img->get_width(), img->get_height(), TRUE, TRUE);
+    gimp_pixel_rgn_set_rect(&rgn, img->get_buffer(), x, y,
+                            img->get_width(), img->get_height());
+    gimp_drawable_preview_draw_region(GIMP_DRAWABLE_PREVIEW(preview), &rgn);
+}
+
+// Filter or enhance part of source into dest, as the preview is for.  An
+// enhanced preview is scaled by the largest value in view, rather than in the
+// whole drawable, so it may come out slightly brighter than the real thing.
+static bool preview_filter(const preview_render &render, uint32_t num_bins,
+                           spectral::Image *source,
+                           uint32_t x_origin, uint32_t y_origin,
+                           uint32_t radius, const PlugInVals *vals,
+                           const cached_source *cached,
+                           spectral::Image *dest)
+{
+    if(render.preview->enhance)
+    {
+        return enhance_image_with_bins(num_bins, source, NULL, x_origin, y_origin,
+                                       radius, vals->threshold,
+                                       vals->linear != FALSE, vals->tile_size,
+                                       vals->num_threads,
+                                       (filter_engine)vals->engine,
+                                       (filter_guide)vals->guide,
+                                       (filter_alpha)vals->alpha, cached,
+                                       vals->contrast, update_preview_progress,
+                                       (void *)&render, dest);
+    }
+    return filter_image_with_bins(num_bins, source, NULL, x_origin, y_origin,
+                                  radius, vals->threshold,
+                                  vals->linear != FALSE, vals->tile_size,
+                                  vals->num_threads,
+                                  (filter_engine)vals->engine,
+                                  (filter_guide)vals->guide,
+                                  (filter_alpha)vals->alpha, cached,
+                                  update_preview_progress, (void *)&render, dest);
+}
+
+bilateral_preview *bilateral_preview_new(GimpDrawable *drawable,
+                                         gboolean enhance)
+{
+    bilateral_preview *result = new bilateral_preview;
+
+    result->drawable = drawable;
+    result->enhance = enhance;
+    result->cache = new spectral::HistogramCache(HISTOGRAM_CACHE_BYTES);
+    result->generation = 0;
+    return result;
+}
+
+void bilateral_preview_free(bilateral_preview *preview)
+{
+    if(preview)
+    {
+        delete preview->cache;
+        delete preview;
+    }
+}
+
+void bilateral_preview_invalidate(bilateral_preview *preview)
+{
+    if(preview)
+    {
+        preview->generation++;
+    }
+}
+
+void bilateral_preview_render(bilateral_preview *preview,
+                              GimpPreview *gimp_preview,
+                              const PlugInVals *vals)
+{
+    GimpDrawable *drawable(preview->drawable);
+    preview_render render = { preview, preview->generation };
+    uint32_t radius(vals->radius), channels(drawable->bpp);
+    spectral::Image *source, *dest;
+    cached_source cached;
+    GimpPixelRgn rgn_in;
+    gint x, y, width, height, x0, y0, x1, y1;
+
+    gimp_preview_get_position(gimp_preview, &x, &y);
+    gimp_preview_get_size(gimp_preview, &width, &height);
+
+    // As for the real thing, the visible area and an apron of radius pixels
+    // around it are read.
+    x0 = MAX(x - (gint)radius, 0);
+    y0 = MAX(y - (gint)radius, 0);
+    x1 = MIN(x + width + (gint)radius, (gint)drawable->width);
+    y1 = MIN(y + height + (gint)radius, (gint)drawable->height);
+
+    source = new spectral::Image(x1 - x0, y1 - y0, channels);
+    gimp_pixel_rgn_init(&rgn_in, drawable, x0, y0, x1 - x0, y1 - y0,
+                        FALSE, FALSE);
+    rgn_to_image(rgn_in, x0, y0, *source);
+
+    // The quick pass works on a shrunk copy, with the radius shrunk to match,
+    // so that something shows up straight away however big the preview is.
+    {
+        uint32_t scale, num_bins;
+
+        scale = 1 + uint32_t(sqrt(double(width) * height / PREVIEW_QUICK_PIXELS));
+        num_bins = MIN((uint32_t)vals->num_bins, PREVIEW_QUICK_BINS);
+
+        if((scale > 1) || (num_bins < (uint32_t)vals->num_bins))
         {
-            delete enhanced;
+            spectral::Image *small, *small_dest;
+            uint32_t small_x, small_y, small_width, small_height;
+
+            small = shrink_image(*source, scale);
+            small_x = (x - x0) / scale;
+            small_y = (y - y0) / scale;
+            small_width = MIN((width + scale - 1) / scale,
+                              small->get_width() - small_x);
+            small_height = MIN((height + scale - 1) / scale,
+                               small->get_height() - small_y);
+            small_dest = new spectral::Image(small_width, small_height, channels);
+
+            if(preview_filter(render, num_bins, small, small_x, small_y,
+                              MAX((radius + (scale / 2)) / scale, 1), vals,
+                              NULL, small_dest))
+            {
+                dest = grow_image(*small_dest, scale,
+                                  (x - x0) % scale, (y - y0) % scale,
+                                  width, height);
+                draw_preview(gimp_preview, drawable, x, y, dest);
+                delete dest;
+            }
+            delete small_dest;
+            delete small;
         }
+    }
 
-        // Finish working.
-        gimp_drawable_flush (drawable);
-        gimp_drawable_merge_shadow (drawable_id, TRUE);
-        gimp_drawable_update (drawable_id, 0, 0, width, height);
+    // Then the real thing.  Its histograms are kept, so that when only the
+    // threshold changes the integral engine can skip building them.
+    cached.cache = preview->cache;
+    cached.id = drawable->drawable_id;
+    cached.x = x0;
+    cached.y = y0;
+
+    dest = new spectral::Image(width, height, channels);
+    if(preview_is_current(render) &&
+            preview_filter(render, vals->num_bins, source, x - x0, y - y0,
+                           radius, vals, &cached, dest))
+    {
+        draw_preview(gimp_preview, drawable, x, y, dest);
     }
+
+    delete dest;
+    delete source;
 }
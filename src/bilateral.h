@@ -2,14 +2,33 @@
 #define __BILATERAL_H__
 #include <stdint.h>
 #include <libgimp/gimp.h>
+#include <libgimp/gimpui.h>
 #include "main.h"
+#include "filter.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
-    void bilateral_filter(uint32_t, uint32_t, uint32_t, int, gboolean, GimpDrawable *);
+    void bilateral_filter(uint32_t, uint32_t, uint32_t, uint32_t, uint32_t, filter_engine, filter_guide, filter_alpha, int, gboolean, GimpDrawable *);
 
-    void bilateral_enhance(uint32_t, uint32_t, float, uint32_t, int, gboolean, GimpDrawable *);
+    void bilateral_enhance(uint32_t, uint32_t, uint32_t, float, uint32_t, uint32_t, filter_engine, filter_guide, filter_alpha, int, gboolean, GimpDrawable *);
+
+    // State kept by the dialog's preview between renders, including the
+    // histograms of what it last filtered.
+    typedef struct _bilateral_preview bilateral_preview;
+
+    // enhance selects a preview of bilateral_enhance rather than the filter.
+    bilateral_preview *bilateral_preview_new(GimpDrawable *, gboolean);
+    void bilateral_preview_free(bilateral_preview *);
+
+    // Make any render in progress give up at its next progress update.
+    void bilateral_preview_invalidate(bilateral_preview *);
+
+    // Filter the visible part of the drawable into the preview, first quickly
+    // at reduced resolution and with few bins, then properly.  Pending gtk
+    // events are handled while it runs, and if they invalidate the preview
+    // it stops early.
+    void bilateral_preview_render(bilateral_preview *, GimpPreview *, const PlugInVals *);
 #ifdef __cplusplus
 }
 #endif
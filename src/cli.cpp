@@ -0,0 +1,364 @@
+// Command line driver for the filter, for use without gimp.  Reads and
+// writes 8 bit binary PNM (P5, P6) and PAM (P7) images; "-" means stdin or
+// stdout.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "filter.h"
+#include "image.h"
+#include "stats.h"
+
+#include "settings.h"
+
+typedef struct _pnm_header
+{
+    char magic;                 // '5', '6' or '7'
+    uint32_t width, height, depth, maxval;
+    char tupltype[64];
+} pnm_header;
+
+// Read the next whitespace separated token, skipping comments.
+static bool read_token(FILE *f, char *token, size_t size)
+{
+    size_t len(0);
+    int c;
+
+    do
+    {
+        c = fgetc(f);
+        if(c == '#')
+        {
+            while((c != EOF) && (c != '\n'))
+            {
+                c = fgetc(f);
+            }
+        }
+    }
+    while((c == ' ') || (c == '\t') || (c == '\r') || (c == '\n'));
+
+    while((c != EOF) && (c != ' ') && (c != '\t') && (c != '\r') && (c != '\n'))
+    {
+        if(len + 1 < size)
+        {
+            token[len++] = c;
+        }
+        c = fgetc(f);
+    }
+    token[len] = 0;
+
+    // The single whitespace character after the header is consumed here.
+    return len > 0;
+}
+
+static bool read_number(FILE *f, uint32_t &value)
+{
+    char token[32];
+    char *end;
+
+    if(!read_token(f, token, sizeof(token)))
+    {
+        return false;
+    }
+    value = strtoul(token, &end, 10);
+    return *end == 0;
+}
+
+static bool read_header(FILE *f, pnm_header &header)
+{
+    char token[64];
+
+    if(!read_token(f, token, sizeof(token)) ||
+            (token[0] != 'P') || !strchr("567", token[1]) || token[2])
+    {
+        return false;
+    }
+    header.magic = token[1];
+    header.depth = (header.magic == '6') ? 3 : 1;
+    header.tupltype[0] = 0;
+
+    if(header.magic != '7')
+    {
+        return read_number(f, header.width) &&
+               read_number(f, header.height) &&
+               read_number(f, header.maxval);
+    }
+
+    header.width = header.height = header.maxval = 0;
+    while(read_token(f, token, sizeof(token)))
+    {
+        if(!strcmp(token, "ENDHDR"))
+        {
+            return true;
+        }
+        else if(!strcmp(token, "WIDTH"))
+        {
+            read_number(f, header.width);
+        }
+        else if(!strcmp(token, "HEIGHT"))
+        {
+            read_number(f, header.height);
+        }
+        else if(!strcmp(token, "DEPTH"))
+        {
+            read_number(f, header.depth);
+        }
+        else if(!strcmp(token, "MAXVAL"))
+        {
+            read_number(f, header.maxval);
+        }
+        else if(!strcmp(token, "TUPLTYPE"))
+        {
+            read_token(f, header.tupltype, sizeof(header.tupltype));
+        }
+    }
+    return false;
+}
+
+static spectral::Image *read_image(const char *name, pnm_header &header)
+{
+    spectral::Image *result(NULL);
+    FILE *f;
+
+    f = strcmp(name, "-") ? fopen(name, "rb") : stdin;
+    if(!f)
+    {
+        fprintf(stderr, "can't open %s\n", name);
+        return NULL;
+    }
+
+    if(!read_header(f, header) || !header.width || !header.height ||
+            !header.depth || (header.depth > 4))
+    {
+        fprintf(stderr, "%s is not a binary PNM or PAM image\n", name);
+    }
+    else if(header.maxval != 255)
+    {
+        fprintf(stderr, "%s: only 8 bit images are supported\n", name);
+    }
+    else
+    {
+        size_t size = (size_t)header.width * header.height * header.depth;
+
+        result = new spectral::Image(header.width, header.height, header.depth);
+        if(fread(result->get_buffer(), 1, size, f) != size)
+        {
+            fprintf(stderr, "%s is truncated\n", name);
+            delete result;
+            result = NULL;
+        }
+    }
+
+    if(f != stdin)
+    {
+        fclose(f);
+    }
+    return result;
+}
+
+static bool write_image(const char *name, const pnm_header &header,
+                        const spectral::Image *img)
+{
+    size_t size;
+    bool result;
+    FILE *f;
+
+    f = strcmp(name, "-") ? fopen(name, "wb") : stdout;
+    if(!f)
+    {
+        fprintf(stderr, "can't create %s\n", name);
+        return false;
+    }
+
+    if(header.magic == '7')
+    {
+        fprintf(f, "P7\nWIDTH %u\nHEIGHT %u\nDEPTH %u\nMAXVAL 255\n",
+                img->get_width(), img->get_height(), img->get_channels());
+        if(header.tupltype[0])
+        {
+            fprintf(f, "TUPLTYPE %s\n", header.tupltype);
+        }
+        fprintf(f, "ENDHDR\n");
+    }
+    else
+    {
+        fprintf(f, "P%c\n%u %u\n255\n", header.magic,
+                img->get_width(), img->get_height());
+    }
+
+    size = (size_t)img->get_width() * img->get_height() * img->get_channels();
+    result = fwrite(img->get_buffer(), 1, size, f) == size;
+
+    if(f != stdout)
+    {
+        result = (fclose(f) == 0) && result;
+    }
+    else
+    {
+        result = (fflush(f) == 0) && result;
+    }
+    if(!result)
+    {
+        fprintf(stderr, "error writing %s\n", name);
+    }
+    return result;
+}
+
+static bool print_progress(void *, double progress)
+{
+    fprintf(stderr, "\r%3d%%", (int)(progress * 100.0));
+    return true;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [options] input output\n"
+            "  -r radius      filter radius (default 5)\n"
+            "  -t threshold   intensity threshold (default 30)\n"
+            "  -b bins        histogram bins, a power of two from 8 to 256\n"
+            "                 (default %d)\n"
+            "  -l             linear rather than quadratic weights\n"
+            "  -s size        integral histogram tile size, 0 to size tiles\n"
+            "                 from memory (default %d)\n"
+            "  -j threads     worker threads, 0 for one per cpu (default %d)\n"
+            "  -e engine      auto, integral, sliding or streaming\n"
+            "  -g guide       weight colour channels together by luma, red,\n"
+            "                 green or blue, or none (default none)\n"
+            "  -a alpha       keep, filter or premultiply alpha (default keep)\n"
+            "  -q             don't report progress\n"
+            "Images are binary PNM (P5, P6) or PAM (P7), 8 bits per sample.\n"
+            "The last of 2 or 4 channels is alpha, unless TUPLTYPE says not.\n",
+            name, DEFAULT_NUM_BINS, DEFAULT_TILE_SIZE, DEFAULT_NUM_THREADS);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t radius(5), threshold(30), num_bins(DEFAULT_NUM_BINS);
+    uint32_t tile_size(DEFAULT_TILE_SIZE), num_threads(DEFAULT_NUM_THREADS);
+    filter_engine engine(FILTER_ENGINE_AUTO);
+    filter_guide guide(FILTER_GUIDE_NONE);
+    filter_alpha alpha(FILTER_ALPHA_KEEP);
+    bool use_linear(false), quiet(false), ok;
+    spectral::Image *source, *dest;
+    pnm_header header;
+    stats_timer timer;
+    int opt;
+
+    while((opt = getopt(argc, argv, "r:t:b:ls:j:e:g:a:q")) != -1)
+    {
+        switch(opt)
+        {
+        case 'r':
+            radius = atoi(optarg);
+            break;
+        case 't':
+            threshold = atoi(optarg);
+            break;
+        case 'b':
+            num_bins = atoi(optarg);
+            if(!filter_bins_supported(num_bins))
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'l':
+            use_linear = true;
+            break;
+        case 's':
+            tile_size = atoi(optarg);
+            break;
+        case 'j':
+            num_threads = atoi(optarg);
+            break;
+        case 'e':
+            for(engine = FILTER_ENGINE_AUTO;
+                    strcmp(optarg, filter_engine_name(engine));
+                    engine = filter_engine(engine + 1))
+            {
+                if(engine == FILTER_ENGINE_STREAMING)
+                {
+                    usage(argv[0]);
+                    return 1;
+                }
+            }
+            break;
+        case 'g':
+            for(guide = FILTER_GUIDE_NONE;
+                    strcmp(optarg, filter_guide_name(guide));
+                    guide = filter_guide(guide + 1))
+            {
+                if(guide == FILTER_GUIDE_BLUE)
+                {
+                    usage(argv[0]);
+                    return 1;
+                }
+            }
+            break;
+        case 'a':
+            for(alpha = FILTER_ALPHA_KEEP;
+                    strcmp(optarg, filter_alpha_name(alpha));
+                    alpha = filter_alpha(alpha + 1))
+            {
+                if(alpha == FILTER_ALPHA_PREMULTIPLIED)
+                {
+                    usage(argv[0]);
+                    return 1;
+                }
+            }
+            break;
+        case 'q':
+            quiet = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if((argc - optind) != 2)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    stats_reset();
+    stats_begin(timer);
+
+    source = read_image(argv[optind], header);
+    if(!source)
+    {
+        return 1;
+    }
+    stats_lap(timer, STATS_READ);
+
+    // A PAM tuple type such as RGB_ALPHA says whether there is alpha.
+    if(header.tupltype[0] && !strstr(header.tupltype, "ALPHA"))
+    {
+        alpha = FILTER_ALPHA_FILTER;
+    }
+    dest = new spectral::Image(source->get_width(), source->get_height(),
+                               source->get_channels());
+
+    filter_image_with_bins(num_bins, source, NULL, 0, 0, radius, threshold,
+                           use_linear, tile_size, num_threads, engine, guide,
+                           alpha, NULL, quiet ? NULL : print_progress, NULL, dest);
+    if(!quiet)
+    {
+        fprintf(stderr, "\n");
+    }
+
+    stats_begin(timer);
+    ok = write_image(argv[optind + 1], header, dest);
+    stats_lap(timer, STATS_WRITE);
+
+    stats_report("cli", dest->get_width(), dest->get_height(),
+                 dest->get_channels(), radius, num_bins);
+
+    delete source;
+    delete dest;
+
+    return ok ? 0 : 1;
+}
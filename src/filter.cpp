@@ -0,0 +1,2626 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "filter.h"
+#include "image.h"
+#include "simd.h"
+#include "stats.h"
+
+#include "settings.h"
+
+// Filter context contains precalculated weights and mean values for various
+// bins and bin/offset combinations.  value_weights holds the same weights
+// expanded out for every input value, with zeros for bins past the threshold,
+// so that filtering a pixel is a fixed length dot product with its histogram.
+// The bin containing the value gets a weight from each side of the value; the
+// lower one is kept in centre_weights, and added separately so that the
+// rounding matches a walk over the bins.  Only the slabs of SLAB bins from
+// first_slab to last_slab - 1 have any weight for a value, and widest_slabs
+// is the most any value needs.
+template <uint32_t BINS>
+struct filter_context
+{
+    enum
+    {
+        NUM_BINS = BINS,
+        BIN_SIZE = 256 / BINS,
+        SLAB = spectral::slab_integral_histogram<uint32_t, BINS>::SLAB
+    };
+
+    uint32_t bin_map[256], offset_map[256];
+    float bin_value[NUM_BINS];
+    float offset_weights[NUM_BINS][BIN_SIZE];
+    float value_weights[256][NUM_BINS];
+    float centre_weights[256];
+    uint32_t first_slab[256], last_slab[256];
+    uint32_t widest_slabs;
+};
+
+// Integrals of filter weights as a function of distance from centre.
+static float linear_integral_fun(float threshold, float x)
+{
+    float integral = x - ((x * x) / (2.0 * threshold));
+    return integral;
+}
+
+static float quadratic_integral_fun(float threshold, float x)
+{
+    float integral = x - ((x * x * x) / (3.0 * threshold * threshold));
+    return integral;
+}
+
+// Initialisation of various lookup tables for bin average intensity values,
+// bin weights for various initial offsets etc.
+template <uint32_t BINS>
+void initialise_filter_context(uint32_t threshold,
+                               bool quadratic,
+                               filter_context<BINS> &ctx)
+{
+    const uint32_t NUM_BINS = filter_context<BINS>::NUM_BINS;
+    const uint32_t BIN_SIZE = filter_context<BINS>::BIN_SIZE;
+
+    float (*get_integral)(float, float)(NULL);
+    float ft;
+    ft = float(threshold)/256.0;
+
+    if(quadratic)
+    {
+        get_integral = quadratic_integral_fun;
+    }
+    else
+    {
+        get_integral = linear_integral_fun;
+    }
+
+    for(uint32_t i=0; i<256; i++)
+    {
+        ctx.bin_map[i] = i / BIN_SIZE;
+        ctx.offset_map[i] = i % BIN_SIZE;
+    }
+
+    for(uint32_t i=0; i<NUM_BINS; i++)
+    {
+        ctx.bin_value[i] = ((i * BIN_SIZE) + ((i+1) * BIN_SIZE))/2.0;
+
+        for(uint32_t j=0; j<BIN_SIZE; j++)
+        {
+            uint32_t near_dist, far_dist;
+
+            near_dist = j + (i * BIN_SIZE);
+            far_dist = near_dist + BIN_SIZE;
+
+            // Spot the edge of the filter kernel.
+            if(far_dist <= threshold)
+            {
+                float near(near_dist), far(far_dist);
+                near/= 256;
+                far/= 256;
+                ctx.offset_weights[i][j] = get_integral(ft, far) - get_integral(ft, near);
+            }
+            else if (near_dist <= threshold)
+            {
+                float near(near_dist), far(threshold);
+                near/= 256;
+                far/= 256;
+                ctx.offset_weights[i][j] = get_integral(ft, far) - get_integral(ft, near);
+            }
+            else
+            {
+                ctx.offset_weights[i][j] = -1;
+            }
+        }
+    }
+
+    // Walk up and down from the bin containing each value, as far as the
+    // threshold allows, and note the weight for each bin.
+    for(uint32_t i=0; i<256; i++)
+    {
+        float *weights = ctx.value_weights[i];
+        uint32_t cur_bin(ctx.bin_map[i]), offset(ctx.offset_map[i]);
+
+        for(uint32_t j=0; j<NUM_BINS; j++)
+        {
+            weights[j] = 0;
+        }
+        ctx.centre_weights[i] = 0;
+
+        for(uint32_t j=0; (cur_bin + j) < NUM_BINS; j++)
+        {
+            uint32_t dist = (BIN_SIZE - offset) + (j * BIN_SIZE);
+            float weight = (dist < 256) ? ctx.offset_weights[dist / BIN_SIZE][dist % BIN_SIZE] : -1;
+
+            if(weight < 0)
+            {
+                break;
+            }
+            weights[cur_bin + j] = weight;
+        }
+        for(uint32_t j=0; j<=cur_bin; j++)
+        {
+            uint32_t dist = offset + (j * BIN_SIZE);
+            float weight = (dist < 256) ? ctx.offset_weights[dist / BIN_SIZE][dist % BIN_SIZE] : -1;
+
+            if(weight < 0)
+            {
+                break;
+            }
+            if(j)
+            {
+                weights[cur_bin - j] = weight;
+            }
+            else
+            {
+                ctx.centre_weights[i] = weight;
+            }
+        }
+    }
+
+    // The slabs with weights for each value, which always include its own.
+    ctx.widest_slabs = 0;
+    for(uint32_t i=0; i<256; i++)
+    {
+        const float *weights = ctx.value_weights[i];
+        uint32_t first(ctx.bin_map[i]), last(ctx.bin_map[i]);
+
+        for(uint32_t j=0; j<NUM_BINS; j++)
+        {
+            if(weights[j] != 0)
+            {
+                first = (j < first) ? j : first;
+                last = (j > last) ? j : last;
+            }
+        }
+        ctx.first_slab[i] = first / filter_context<BINS>::SLAB;
+        ctx.last_slab[i] = (last / filter_context<BINS>::SLAB) + 1;
+        if((ctx.last_slab[i] - ctx.first_slab[i]) > ctx.widest_slabs)
+        {
+            ctx.widest_slabs = ctx.last_slab[i] - ctx.first_slab[i];
+        }
+    }
+}
+
+// Weighted count and weighted sum of bin values for a histogram, given the
+// weights for one input value.  The widest version the cpu supports is picked
+// at startup.
+typedef void (*dot_bins_fun)(const float *weights, const float *values,
+                             const uint32_t *bins,
+                             float &total_weight, float &total_value);
+
+template <uint32_t BINS>
+static void dot_bins_scalar(const float *weights, const float *values,
+                            const uint32_t *bins,
+                            float &total_weight, float &total_value)
+{
+    float tw(0), tv(0);
+
+    for(uint32_t i=0; i<BINS; i++)
+    {
+        float count = bins[i];
+        float t = weights[i] * count;
+        tw+= t;
+        tv+= t * values[i];
+    }
+    total_weight = tw;
+    total_value = tv;
+}
+
+#if defined(HAVE_X86_SIMD)
+template <uint32_t BINS>
+__attribute__((target("sse2")))
+static void dot_bins_sse2(const float *weights, const float *values,
+                          const uint32_t *bins,
+                          float &total_weight, float &total_value)
+{
+    __m128 tw = _mm_setzero_ps(), tv = _mm_setzero_ps();
+    float w[4], v[4];
+    uint32_t i(0);
+
+    for(; i+4<=BINS; i+=4)
+    {
+        __m128 count = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(bins + i)));
+        __m128 t = _mm_mul_ps(_mm_loadu_ps(weights + i), count);
+        tw = _mm_add_ps(tw, t);
+        tv = _mm_add_ps(tv, _mm_mul_ps(t, _mm_loadu_ps(values + i)));
+    }
+    _mm_storeu_ps(w, tw);
+    _mm_storeu_ps(v, tv);
+    total_weight = (w[0] + w[1]) + (w[2] + w[3]);
+    total_value = (v[0] + v[1]) + (v[2] + v[3]);
+
+    for(; i<BINS; i++)
+    {
+        float count = bins[i];
+        float t = weights[i] * count;
+        total_weight+= t;
+        total_value+= t * values[i];
+    }
+}
+
+template <uint32_t BINS>
+__attribute__((target("avx2")))
+static void dot_bins_avx2(const float *weights, const float *values,
+                          const uint32_t *bins,
+                          float &total_weight, float &total_value)
+{
+    __m256 tw = _mm256_setzero_ps(), tv = _mm256_setzero_ps();
+    float w[8], v[8];
+    uint32_t i(0);
+
+    for(; i+8<=BINS; i+=8)
+    {
+        __m256 count = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i *)(bins + i)));
+        __m256 t = _mm256_mul_ps(_mm256_loadu_ps(weights + i), count);
+        tw = _mm256_add_ps(tw, t);
+        tv = _mm256_add_ps(tv, _mm256_mul_ps(t, _mm256_loadu_ps(values + i)));
+    }
+    _mm256_storeu_ps(w, tw);
+    _mm256_storeu_ps(v, tv);
+    total_weight = ((w[0] + w[1]) + (w[2] + w[3])) + ((w[4] + w[5]) + (w[6] + w[7]));
+    total_value = ((v[0] + v[1]) + (v[2] + v[3])) + ((v[4] + v[5]) + (v[6] + v[7]));
+
+    for(; i<BINS; i++)
+    {
+        float count = bins[i];
+        float t = weights[i] * count;
+        total_weight+= t;
+        total_value+= t * values[i];
+    }
+}
+#endif
+
+template <uint32_t BINS>
+static dot_bins_fun select_dot_bins(void)
+{
+#if defined(HAVE_X86_SIMD)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+    {
+        return dot_bins_avx2<BINS>;
+    }
+    if(__builtin_cpu_supports("sse2"))
+    {
+        return dot_bins_sse2<BINS>;
+    }
+#endif
+    return dot_bins_scalar<BINS>;
+}
+
+template <uint32_t BINS>
+static dot_bins_fun get_dot_bins(void)
+{
+    static const dot_bins_fun dot_bins = select_dot_bins<BINS>();
+    return dot_bins;
+}
+
+// The dot_bins kernel for a span of bins chosen at runtime.  Spans start on a
+// multiple of 8, so each lane of the vector kernels adds up the same bins in
+// the same order as it would over all of them, and bins outside the span
+// would only have added zeros, so the totals come out exactly the same.
+static dot_bins_fun get_span_dot_bins(uint32_t span)
+{
+    switch(span)
+    {
+    case 8:
+        return get_dot_bins<8>();
+    case 16:
+        return get_dot_bins<16>();
+    case 32:
+        return get_dot_bins<32>();
+    case 64:
+        return get_dot_bins<64>();
+    case 128:
+        return get_dot_bins<128>();
+    default:
+        return get_dot_bins<256>();
+    }
+}
+
+// As dot_bins, over a number of bins chosen at runtime, which must be a
+// multiple of 8.  Each lane adds up the same bins in the same order as
+// dot_bins would from the same starting point, so that skipping bins that
+// could only add zeros leaves the totals exactly as they were.
+typedef void (*dot_slabs_fun)(const float *weights, const float *values,
+                              const uint32_t *bins, uint32_t count,
+                              float &total_weight, float &total_value);
+
+static void dot_slabs_scalar(const float *weights, const float *values,
+                             const uint32_t *bins, uint32_t count,
+                             float &total_weight, float &total_value)
+{
+    float tw(0), tv(0);
+
+    for(uint32_t i=0; i<count; i++)
+    {
+        float c = bins[i];
+        float t = weights[i] * c;
+        tw+= t;
+        tv+= t * values[i];
+    }
+    total_weight = tw;
+    total_value = tv;
+}
+
+#if defined(HAVE_X86_SIMD)
+__attribute__((target("sse2")))
+static void dot_slabs_sse2(const float *weights, const float *values,
+                           const uint32_t *bins, uint32_t count,
+                           float &total_weight, float &total_value)
+{
+    __m128 tw = _mm_setzero_ps(), tv = _mm_setzero_ps();
+    float w[4], v[4];
+
+    for(uint32_t i=0; i<count; i+=4)
+    {
+        __m128 c = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(bins + i)));
+        __m128 t = _mm_mul_ps(_mm_loadu_ps(weights + i), c);
+        tw = _mm_add_ps(tw, t);
+        tv = _mm_add_ps(tv, _mm_mul_ps(t, _mm_loadu_ps(values + i)));
+    }
+    _mm_storeu_ps(w, tw);
+    _mm_storeu_ps(v, tv);
+    total_weight = (w[0] + w[1]) + (w[2] + w[3]);
+    total_value = (v[0] + v[1]) + (v[2] + v[3]);
+}
+
+__attribute__((target("avx2")))
+static void dot_slabs_avx2(const float *weights, const float *values,
+                           const uint32_t *bins, uint32_t count,
+                           float &total_weight, float &total_value)
+{
+    __m256 tw = _mm256_setzero_ps(), tv = _mm256_setzero_ps();
+    float w[8], v[8];
+
+    for(uint32_t i=0; i<count; i+=8)
+    {
+        __m256 c = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i *)(bins + i)));
+        __m256 t = _mm256_mul_ps(_mm256_loadu_ps(weights + i), c);
+        tw = _mm256_add_ps(tw, t);
+        tv = _mm256_add_ps(tv, _mm256_mul_ps(t, _mm256_loadu_ps(values + i)));
+    }
+    _mm256_storeu_ps(w, tw);
+    _mm256_storeu_ps(v, tv);
+    total_weight = ((w[0] + w[1]) + (w[2] + w[3])) + ((w[4] + w[5]) + (w[6] + w[7]));
+    total_value = ((v[0] + v[1]) + (v[2] + v[3])) + ((v[4] + v[5]) + (v[6] + v[7]));
+}
+#endif
+
+static dot_slabs_fun select_dot_slabs(void)
+{
+#if defined(HAVE_X86_SIMD)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+    {
+        return dot_slabs_avx2;
+    }
+    if(__builtin_cpu_supports("sse2"))
+    {
+        return dot_slabs_sse2;
+    }
+#endif
+    return dot_slabs_scalar;
+}
+
+static dot_slabs_fun get_dot_slabs(void)
+{
+    static const dot_slabs_fun dot_slabs = select_dot_slabs();
+    return dot_slabs;
+}
+
+// The filtered value, from the weighted totals of the bins other than the
+// one holding cur_val.
+template <uint32_t BINS>
+static inline uint8_t weighted_mean(const filter_context<BINS> &ctx,
+                                    const uint32_t *bins,
+                                    uint32_t cur_val,
+                                    float total_weight,
+                                    float total_value)
+{
+    uint32_t value;
+
+    {
+        uint32_t cur_bin = ctx.bin_map[cur_val];
+        float this_weight = ctx.centre_weights[cur_val] * bins[cur_bin];
+
+        total_weight+= this_weight;
+        total_value+= this_weight * ctx.bin_value[cur_bin];
+    }
+
+    if(total_weight > 0)
+    {
+        value = trunc(total_value/total_weight);
+        if(value > 255)
+        {
+            value = 255;
+        }
+    }
+    else
+    {
+        value = 0;
+    }
+    return value & 255;
+}
+
+// Filter a single value, given the histogram of the window around it.  If
+// only some of the bins can be occupied, dot_bins may cover just those,
+// starting at first_bin.
+template <uint32_t BINS>
+static inline uint8_t filter_pixel(const filter_context<BINS> &ctx,
+                                   dot_bins_fun dot_bins,
+                                   const uint32_t *bins,
+                                   uint32_t cur_val,
+                                   uint32_t first_bin = 0)
+{
+    float total_value, total_weight;
+
+    dot_bins(ctx.value_weights[cur_val] + first_bin, ctx.bin_value + first_bin,
+             bins + first_bin, total_weight, total_value);
+    return weighted_mean(ctx, bins, cur_val, total_weight, total_value);
+}
+
+// Weighted totals of each plane of a joint histogram, given the weights for
+// one guide value.  Picked at startup as for dot_bins.
+typedef void (*dot_joint_bins_fun)(const float *weights, const uint32_t *bins,
+                                   float *totals);
+
+template <uint32_t BINS, uint32_t PLANES>
+static void dot_joint_bins_scalar(const float *weights, const uint32_t *bins,
+                                  float *totals)
+{
+    for(uint32_t p=0; p<PLANES; p++)
+    {
+        float t(0);
+
+        for(uint32_t i=0; i<BINS; i++)
+        {
+            t+= weights[i] * float(bins[i]);
+        }
+        totals[p] = t;
+        bins+= BINS;
+    }
+}
+
+#if defined(HAVE_X86_SIMD)
+// Counts and sums stay below 2^31 (see max_window_area), so the signed
+// conversion is safe.
+template <uint32_t BINS, uint32_t PLANES>
+__attribute__((target("sse2")))
+static void dot_joint_bins_sse2(const float *weights, const uint32_t *bins,
+                                float *totals)
+{
+    for(uint32_t p=0; p<PLANES; p++)
+    {
+        __m128 t = _mm_setzero_ps();
+        float v[4];
+
+        for(uint32_t i=0; i<BINS; i+=4)
+        {
+            __m128 count = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(bins + i)));
+            t = _mm_add_ps(t, _mm_mul_ps(_mm_loadu_ps(weights + i), count));
+        }
+        _mm_storeu_ps(v, t);
+        totals[p] = (v[0] + v[1]) + (v[2] + v[3]);
+        bins+= BINS;
+    }
+}
+
+template <uint32_t BINS, uint32_t PLANES>
+__attribute__((target("avx2")))
+static void dot_joint_bins_avx2(const float *weights, const uint32_t *bins,
+                                float *totals)
+{
+    for(uint32_t p=0; p<PLANES; p++)
+    {
+        __m256 t = _mm256_setzero_ps();
+        float v[8];
+
+        for(uint32_t i=0; i<BINS; i+=8)
+        {
+            __m256 count = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i *)(bins + i)));
+            t = _mm256_add_ps(t, _mm256_mul_ps(_mm256_loadu_ps(weights + i), count));
+        }
+        _mm256_storeu_ps(v, t);
+        totals[p] = ((v[0] + v[1]) + (v[2] + v[3])) + ((v[4] + v[5]) + (v[6] + v[7]));
+        bins+= BINS;
+    }
+}
+#endif
+
+template <uint32_t BINS, uint32_t PLANES>
+static dot_joint_bins_fun select_dot_joint_bins(void)
+{
+#if defined(HAVE_X86_SIMD)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+    {
+        return dot_joint_bins_avx2<BINS, PLANES>;
+    }
+    if(__builtin_cpu_supports("sse2"))
+    {
+        return dot_joint_bins_sse2<BINS, PLANES>;
+    }
+#endif
+    return dot_joint_bins_scalar<BINS, PLANES>;
+}
+
+template <uint32_t BINS, uint32_t PLANES>
+static dot_joint_bins_fun get_dot_joint_bins(void)
+{
+    static const dot_joint_bins_fun dot_joint_bins = select_dot_joint_bins<BINS, PLANES>();
+    return dot_joint_bins;
+}
+
+// Filter the colour channels of a pixel together, given the joint histogram
+// of the window around it and its guide value.  The bin sums give each
+// channel's mean exactly, rather than from the bin's centre value.  A pixel
+// with nothing to average is left as it is.
+template <uint32_t BINS>
+static inline void filter_joint_pixel(const filter_context<BINS> &ctx,
+                                      dot_joint_bins_fun dot_joint_bins,
+                                      const uint32_t *bins,
+                                      uint32_t guide_val,
+                                      const uint8_t *in,
+                                      uint8_t *out)
+{
+    const uint32_t PLANES = spectral::joint_histogram_base::PLANES;
+    float totals[PLANES];
+
+    dot_joint_bins(ctx.value_weights[guide_val], bins, totals);
+    {
+        uint32_t cur_bin = ctx.bin_map[guide_val];
+        float centre_weight = ctx.centre_weights[guide_val];
+
+        for(uint32_t p=0; p<PLANES; p++)
+        {
+            totals[p]+= centre_weight * float(bins[(p * BINS) + cur_bin]);
+        }
+    }
+
+    for(uint32_t c=0; c<spectral::joint_histogram_base::CHANNELS; c++)
+    {
+        if(totals[0] > 0)
+        {
+            uint32_t value = trunc(totals[c + 1]/totals[0]);
+
+            out[c] = (value > 255) ? 255 : value;
+        }
+        else
+        {
+            out[c] = in[c];
+        }
+    }
+}
+
+// Filter one channel of a tile of dest.  dest holds the filtered version of
+// the part of source with its top left corner at (x_origin, y_origin), and
+// the window around each pixel is taken from source.
+template <uint32_t BINS, typename H>
+void filter_tile(const H *hist,
+                 const spectral::ImageView &source,
+                 const filter_context<BINS> &ctx,
+                 uint32_t radius,
+                 uint32_t x_origin,
+                 uint32_t y_origin,
+                 uint32_t x_offset,
+                 uint32_t y_offset,
+                 uint32_t width,
+                 uint32_t height,
+                 uint32_t channel,
+                 const spectral::ImageView &dest)
+{
+    uint32_t channels, first_bin;
+    dot_bins_fun dot_bins;
+
+    channels = dest.get_channels();
+
+    if((width + x_offset) > dest.get_width())
+    {
+        width = dest.get_width() - x_offset;
+    }
+    if((height + y_offset) > dest.get_height())
+    {
+        height = dest.get_height() - y_offset;
+    }
+
+    if(hist)
+    {
+        first_bin = hist->get_first_bin();
+        dot_bins = (hist->get_span() == BINS) ? get_dot_bins<BINS>()
+                                              : get_span_dot_bins(hist->get_span());
+
+        for(uint32_t y=0; y<height; y++)
+        {
+            uint32_t row_index, window((radius * 2) + 1), span(hist->get_span());
+            const uint8_t *in_row;
+            uint8_t *row;
+            const typename H::value_type *top, *bottom;
+
+            row_index = channel;
+            in_row = source.get_pixel(x_offset + x_origin, y + y_offset + y_origin);
+            row = dest.get_pixel(x_offset, y + y_offset);
+
+            // The window of each pixel in the row, moving right one entry
+            // at a time.  Only the bins the histogram holds are filled in.
+            hist->GetRows(y, window, top, bottom);
+
+            for(uint32_t x=0; x<width; x++)
+            {
+                uint32_t bins[BINS];
+
+                hist->GetWindow(top, bottom, window, bins + first_bin);
+                top+= span;
+                bottom+= span;
+
+                row[row_index] = filter_pixel(ctx, dot_bins, bins,
+                                              in_row[row_index], first_bin);
+                row_index+= channels;
+            }
+        }
+    }
+}
+
+// As filter_tile, with a bin major histogram.  Each pixel only fetches and
+// weighs the slabs of bins that have weights for its value, and that the
+// histogram holds; any others would only have added zeros.
+template <uint32_t BINS, typename T>
+void filter_tile(const spectral::slab_integral_histogram<T, BINS> *hist,
+                 const spectral::ImageView &source,
+                 const filter_context<BINS> &ctx,
+                 uint32_t radius,
+                 uint32_t x_origin,
+                 uint32_t y_origin,
+                 uint32_t x_offset,
+                 uint32_t y_offset,
+                 uint32_t width,
+                 uint32_t height,
+                 uint32_t channel,
+                 const spectral::ImageView &dest)
+{
+    const uint32_t SLAB = filter_context<BINS>::SLAB;
+    uint32_t channels, held_first, held_last;
+    dot_slabs_fun dot_slabs = get_dot_slabs();
+
+    channels = dest.get_channels();
+
+    if((width + x_offset) > dest.get_width())
+    {
+        width = dest.get_width() - x_offset;
+    }
+    if((height + y_offset) > dest.get_height())
+    {
+        height = dest.get_height() - y_offset;
+    }
+
+    if(hist)
+    {
+        held_first = hist->get_first_bin() / SLAB;
+        held_last = held_first + (hist->get_span() / SLAB);
+
+        for(uint32_t y=0; y<height; y++)
+        {
+            uint32_t row_index, window((radius * 2) + 1);
+            const uint8_t *in_row;
+            uint8_t *row;
+            const T *top, *bottom;
+
+            row_index = channel;
+            in_row = source.get_pixel(x_offset + x_origin, y + y_offset + y_origin);
+            row = dest.get_pixel(x_offset, y + y_offset);
+
+            hist->GetRows(y, window, top, bottom);
+
+            for(uint32_t x=0; x<width; x++)
+            {
+                uint32_t bins[BINS];
+                uint32_t cur_val(in_row[row_index]), first, last;
+                float total_weight, total_value;
+
+                first = ctx.first_slab[cur_val];
+                last = ctx.last_slab[cur_val];
+                first = (first < held_first) ? held_first : first;
+                last = (last > held_last) ? held_last : last;
+
+                hist->GetSlabs(top, bottom, window, first - held_first,
+                               last - held_first, bins + (first * SLAB));
+                top+= SLAB;
+                bottom+= SLAB;
+
+                dot_slabs(ctx.value_weights[cur_val] + (first * SLAB),
+                          ctx.bin_value + (first * SLAB), bins + (first * SLAB),
+                          (last - first) * SLAB, total_weight, total_value);
+                row[row_index] = weighted_mean(ctx, bins, cur_val,
+                                               total_weight, total_value);
+                row_index+= channels;
+            }
+        }
+    }
+}
+
+// Filter one channel of a tile of dest, as filter_tile, when every value in
+// reach of its windows lies between lo and hi, which share a bin.  Every
+// window then has the same histogram, and the result depends only on the
+// value being filtered, so it is worked out once for each of them.
+template <uint32_t BINS>
+void filter_flat_tile(const spectral::ImageView &source,
+                      const filter_context<BINS> &ctx,
+                      uint32_t radius,
+                      uint32_t x_origin,
+                      uint32_t y_origin,
+                      uint32_t x_offset,
+                      uint32_t y_offset,
+                      uint32_t width,
+                      uint32_t height,
+                      uint32_t channel,
+                      uint8_t lo,
+                      uint8_t hi,
+                      const spectral::ImageView &dest)
+{
+    uint32_t bins[BINS], window((radius * 2) + 1);
+    uint8_t filtered[256];
+    uint32_t channels;
+    dot_bins_fun dot_bins = get_dot_bins<BINS>();
+
+    channels = dest.get_channels();
+
+    if((width + x_offset) > dest.get_width())
+    {
+        width = dest.get_width() - x_offset;
+    }
+    if((height + y_offset) > dest.get_height())
+    {
+        height = dest.get_height() - y_offset;
+    }
+
+    memset(bins, 0, sizeof(bins));
+    bins[ctx.bin_map[lo]] = window * window;
+    for(uint32_t i=lo; i<=hi; i++)
+    {
+        filtered[i] = filter_pixel(ctx, dot_bins, bins, i);
+    }
+
+    for(uint32_t y=0; y<height; y++)
+    {
+        const uint8_t *in;
+        uint8_t *out;
+
+        in = source.get_pixel(x_offset + x_origin, y + y_offset + y_origin) + channel;
+        out = dest.get_pixel(x_offset, y + y_offset) + channel;
+
+        for(uint32_t x=0; x<width; x++)
+        {
+            *out = filtered[*in];
+            in+= channels;
+            out+= channels;
+        }
+    }
+}
+
+// Filter a region using a sliding histogram.  Unlike filter_tile, the window
+// histograms are produced in raster order, so the region may be any size.
+template <uint32_t BINS>
+void filter_strip(spectral::sliding_histogram<BINS> *hist,
+                  const spectral::ImageView &source,
+                  const filter_context<BINS> &ctx,
+                  uint32_t radius,
+                  uint32_t x_origin,
+                  uint32_t y_origin,
+                  uint32_t x_offset,
+                  uint32_t y_offset,
+                  uint32_t width,
+                  uint32_t height,
+                  uint32_t channel,
+                  const spectral::ImageView &dest)
+{
+    uint32_t channels;
+    dot_bins_fun dot_bins = get_dot_bins<BINS>();
+
+    channels = dest.get_channels();
+
+    if((width + x_offset) > dest.get_width())
+    {
+        width = dest.get_width() - x_offset;
+    }
+    if((height + y_offset) > dest.get_height())
+    {
+        height = dest.get_height() - y_offset;
+    }
+
+    if(hist)
+    {
+        stats_timer timer;
+
+        stats_begin(timer);
+        hist->Reset(source, int32_t(x_offset + x_origin) - int32_t(radius),
+                    int32_t(y_offset + y_origin) - int32_t(radius),
+                    width + (radius * 2), (radius * 2) + 1, channel);
+        stats_lap(timer, STATS_BUILD);
+
+        for(uint32_t y=0; y<height; y++)
+        {
+            uint32_t bins[BINS];
+            uint32_t row_index;
+            const uint8_t *in_row;
+            uint8_t *row;
+
+            if(y)
+            {
+                hist->NextRow();
+                stats_lap(timer, STATS_BUILD);
+            }
+
+            row_index = channel;
+            in_row = source.get_pixel(x_offset + x_origin, y + y_offset + y_origin);
+            row = dest.get_pixel(x_offset, y + y_offset);
+
+            hist->FirstWindow(bins);
+
+            for(uint32_t x=0; x<width; x++)
+            {
+                if(x)
+                {
+                    hist->NextWindow(bins);
+                }
+
+                row[row_index] = filter_pixel(ctx, dot_bins, bins, in_row[row_index]);
+                row_index+= channels;
+            }
+            stats_lap(timer, STATS_FILTER);
+        }
+    }
+}
+
+// As filter_strip, but filtering the colour channels together with weights
+// taken from guide.
+template <uint32_t BINS, typename H>
+void filter_joint_strip(H *hist,
+                        const spectral::ImageView &source,
+                        const filter_context<BINS> &ctx,
+                        uint32_t radius,
+                        uint32_t x_origin,
+                        uint32_t y_origin,
+                        uint32_t x_offset,
+                        uint32_t y_offset,
+                        uint32_t width,
+                        uint32_t height,
+                        uint32_t guide,
+                        const spectral::ImageView &dest)
+{
+    uint32_t channels;
+    dot_joint_bins_fun dot_joint_bins = get_dot_joint_bins<BINS, H::PLANES>();
+
+    channels = dest.get_channels();
+
+    if((width + x_offset) > dest.get_width())
+    {
+        width = dest.get_width() - x_offset;
+    }
+    if((height + y_offset) > dest.get_height())
+    {
+        height = dest.get_height() - y_offset;
+    }
+
+    if(hist)
+    {
+        stats_timer timer;
+
+        stats_begin(timer);
+        hist->Reset(source, int32_t(x_offset + x_origin) - int32_t(radius),
+                    int32_t(y_offset + y_origin) - int32_t(radius),
+                    width + (radius * 2), (radius * 2) + 1, guide);
+        stats_lap(timer, STATS_BUILD);
+
+        for(uint32_t y=0; y<height; y++)
+        {
+            uint32_t bins[H::PLANES * BINS];
+            const uint8_t *in_row;
+            uint8_t *row;
+
+            if(y)
+            {
+                hist->NextRow();
+                stats_lap(timer, STATS_BUILD);
+            }
+
+            in_row = source.get_pixel(x_offset + x_origin, y + y_offset + y_origin);
+            row = dest.get_pixel(x_offset, y + y_offset);
+
+            hist->FirstWindow(bins);
+
+            for(uint32_t x=0; x<width; x++)
+            {
+                if(x)
+                {
+                    hist->NextWindow(bins);
+                }
+
+                filter_joint_pixel(ctx, dot_joint_bins, bins,
+                                   H::get_guide(in_row, guide),
+                                   in_row, row);
+                in_row+= channels;
+                row+= channels;
+            }
+            stats_lap(timer, STATS_FILTER);
+        }
+    }
+}
+
+// Filter a region with a rolling integral histogram, building each integral
+// row just before the output row that first needs it.
+template <uint32_t BINS, typename H>
+void filter_stream(H *hist,
+                   const spectral::ImageView &source,
+                   const filter_context<BINS> &ctx,
+                   uint32_t radius,
+                   uint32_t x_origin,
+                   uint32_t y_origin,
+                   uint32_t x_offset,
+                   uint32_t y_offset,
+                   uint32_t width,
+                   uint32_t height,
+                   uint32_t channel,
+                   const spectral::ImageView &dest)
+{
+    uint32_t channels;
+    dot_bins_fun dot_bins = get_dot_bins<BINS>();
+
+    channels = dest.get_channels();
+
+    if((width + x_offset) > dest.get_width())
+    {
+        width = dest.get_width() - x_offset;
+    }
+    if((height + y_offset) > dest.get_height())
+    {
+        height = dest.get_height() - y_offset;
+    }
+
+    if(hist)
+    {
+        stats_timer timer;
+
+        stats_begin(timer);
+        hist->Reset(source, int32_t(x_offset + x_origin) - int32_t(radius),
+                    int32_t(y_offset + y_origin) - int32_t(radius),
+                    width + (radius * 2), (radius * 2) + 1, channel);
+        stats_lap(timer, STATS_BUILD);
+
+        for(uint32_t y=0; y<height; y++)
+        {
+            uint32_t row_index;
+            const uint8_t *in_row;
+            uint8_t *row;
+
+            if(y)
+            {
+                hist->NextRow();
+                stats_lap(timer, STATS_BUILD);
+            }
+
+            row_index = channel;
+            in_row = source.get_pixel(x_offset + x_origin, y + y_offset + y_origin);
+            row = dest.get_pixel(x_offset, y + y_offset);
+
+            for(uint32_t x=0; x<width; x++)
+            {
+                uint32_t bins[BINS];
+
+                hist->GetHistogram(x, x + (radius * 2), bins);
+
+                row[row_index] = filter_pixel(ctx, dot_bins, bins, in_row[row_index]);
+                row_index+= channels;
+            }
+            stats_lap(timer, STATS_FILTER);
+        }
+    }
+}
+
+// Detail enhancement, which is worked out alongside the filter.
+typedef struct _enhance_state
+{
+    float contrast;
+    float max;                  // largest enhanced value, once filtered
+} enhance_state;
+
+// One unit of work for the tile scheduler: a single channel of one tile, or
+// all the colour channels at once when filtering with a guide.
+typedef struct _tile_job
+{
+    uint32_t x, y, next_x, next_y;
+    uint32_t channel;
+    bool joint;                 // the colour channels, rather than channel
+} tile_job;
+
+// Each worker owns a contiguous run of jobs [first, last), and takes work
+// from the front of it.  A worker that runs dry steals the back half of the
+// largest remaining run, so neighbouring tiles tend to stay on one thread.
+typedef struct _job_range
+{
+    uint32_t first, last;
+} job_range;
+
+typedef struct _tile_scheduler
+{
+    spectral::ImageView source;
+    const void *ctx;            // filter_context for the bin count in use
+    spectral::ImageView dest;
+    uint32_t x_origin, y_origin;    // position of dest within source
+    uint32_t tile_width, tile_height, radius;
+
+    tile_job *jobs;
+    uint32_t num_jobs, jobs_done;
+
+    job_range *ranges;
+    uint32_t num_workers;
+
+    filter_engine engine;
+
+    // Where the integral engine keeps its histograms, or NULL.
+    const cached_source *cached;
+
+    // Guide for joint jobs: a colour channel, or joint_sliding_histogram's
+    // LUMA.  Joint jobs cover channels 0 to joint_channels - 1, and there
+    // are none if joint_channels is 0.
+    uint32_t guide, joint_channels;
+
+    // Detail enhancement, for which each job also finds the largest enhanced
+    // value in its part of dest.
+    bool enhance;
+    float contrast;
+
+    // Width of the bands used by the streaming engine.
+    uint32_t stream_width;
+
+    // Use 16 bit histograms, which is exact when windows are small enough.
+    // Joint histogram columns then fit in 16 bits too, since a window of at
+    // most 65535 pixels is at most 255 high.
+    bool narrow_counts;
+
+    // Store integral histograms bin major, for thresholds small enough that
+    // each pixel only needs a few of the bins.
+    bool slab_layout;
+
+    // Rows of the source read so far.  A job waits until every row its
+    // window touches is in.
+    uint32_t rows_ready;
+
+    // Set when the progress callback asks to stop.  No new jobs are handed
+    // out after that.
+    bool cancelled;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t done_cond;
+    pthread_cond_t ready_cond;
+} tile_scheduler;
+
+typedef struct _tile_worker
+{
+    tile_scheduler *sched;
+    uint32_t id;
+    float enhance_max;          // largest enhanced value of this worker's jobs
+} tile_worker;
+
+uint32_t get_num_threads(uint32_t requested)
+{
+    uint32_t result(requested);
+
+    if(!result)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        result = (cpus > 0) ? uint32_t(cpus) : 1;
+    }
+    return result;
+}
+
+// Fetch the next job for a worker, stealing if its own run is empty.
+// Returns false once there is no work left anywhere, or the filter has been
+// cancelled.
+static bool next_tile_job(tile_scheduler &sched, uint32_t id, uint32_t &job)
+{
+    bool result(false);
+
+    pthread_mutex_lock(&sched.mutex);
+    if(!sched.cancelled)
+    {
+        job_range &own = sched.ranges[id];
+
+        if(own.first == own.last)
+        {
+            uint32_t victim(id), most(0);
+
+            for(uint32_t i=0; i<sched.num_workers; i++)
+            {
+                uint32_t remaining = sched.ranges[i].last - sched.ranges[i].first;
+                if(remaining > most)
+                {
+                    most = remaining;
+                    victim = i;
+                }
+            }
+            if(most)
+            {
+                job_range &other = sched.ranges[victim];
+                uint32_t split = other.last - ((most + 1) / 2);
+
+                own.first = split;
+                own.last = other.last;
+                other.last = split;
+            }
+        }
+        if(own.first < own.last)
+        {
+            job = own.first++;
+            result = true;
+        }
+    }
+    if(result)
+    {
+        uint32_t needed = sched.jobs[job].next_y + sched.y_origin + sched.radius;
+
+        if(needed > sched.source.get_height())
+        {
+            needed = sched.source.get_height();
+        }
+        while((sched.rows_ready < needed) && !sched.cancelled)
+        {
+            pthread_cond_wait(&sched.ready_cond, &sched.mutex);
+        }
+        result = !sched.cancelled;
+    }
+    pthread_mutex_unlock(&sched.mutex);
+
+    return result;
+}
+
+// Stop handing out jobs, and wake any worker waiting for rows that will now
+// never be read.  Called with the mutex held.
+static void cancel_tile_jobs(tile_scheduler &sched)
+{
+    sched.cancelled = true;
+    pthread_cond_broadcast(&sched.ready_cond);
+}
+
+// A sample pushed away from its filtered value, which is where the detail
+// lies.  Worked in double and kept in float.
+static inline float enhance_sample(uint8_t original, uint8_t filtered,
+                                   float contrast)
+{
+    double value(original);
+
+    return float(value + ((value - filtered) * contrast));
+}
+
+// The largest enhanced value in channels first to last - 1 of the part of
+// dest from (x0, y0) to (x1, y1), or 0 if none is larger.  source is the
+// original, of which dest covers the part at (x_origin, y_origin).
+static float get_enhanced_max(const spectral::ImageView &source,
+                              uint32_t x_origin, uint32_t y_origin,
+                              const spectral::ImageView &dest,
+                              uint32_t x0, uint32_t y0,
+                              uint32_t x1, uint32_t y1,
+                              uint32_t first, uint32_t last,
+                              float contrast)
+{
+    float result(0);
+
+    for(uint32_t y=y0; y<y1; y++)
+    {
+        const uint8_t *in, *out;
+
+        in = source.get_pixel(x0 + x_origin, y + y_origin);
+        out = dest.get_pixel(x0, y);
+
+        for(uint32_t x=x0; x<x1; x++)
+        {
+            for(uint32_t c=first; c<last; c++)
+            {
+                float value = enhance_sample(in[c], out[c], contrast);
+
+                if(value > result)
+                {
+                    result = value;
+                }
+            }
+            in+= source.get_channels();
+            out+= dest.get_channels();
+        }
+    }
+    return result;
+}
+
+// Called once a job's part of dest has been filtered.  When enhancing, its
+// largest enhanced value is found now, while its pixels are still in cache.
+static void finish_tile_job(tile_worker *worker, const tile_job &job)
+{
+    tile_scheduler &sched = *(worker->sched);
+
+    if(sched.enhance)
+    {
+        stats_timer timer;
+        float job_max;
+
+        stats_begin(timer);
+        job_max = get_enhanced_max(sched.source, sched.x_origin, sched.y_origin,
+                                   sched.dest, job.x, job.y,
+                                   job.next_x, job.next_y,
+                                   job.joint ? 0 : job.channel,
+                                   job.joint ? sched.joint_channels
+                                             : job.channel + 1,
+                                   sched.contrast);
+        if(job_max > worker->enhance_max)
+        {
+            worker->enhance_max = job_max;
+        }
+        stats_lap(timer, STATS_ENHANCE);
+    }
+
+    pthread_mutex_lock(&sched.mutex);
+    sched.jobs_done++;
+    pthread_cond_signal(&sched.done_cond);
+    pthread_mutex_unlock(&sched.mutex);
+}
+
+// The smallest and largest values in one channel of a region of img,
+// reflected border included, and if checksum is given, a checksum of them to
+// tell whether a cached histogram was built from the same pixels.  row must
+// hold width pixels.
+static void scan_region(const spectral::ImageView &img,
+                        int32_t x0, int32_t y0,
+                        uint32_t width, uint32_t height,
+                        uint32_t channel, uint8_t *row,
+                        uint8_t &lo, uint8_t &hi, uint64_t *checksum)
+{
+    uint64_t sum(14695981039346656037ULL);
+    uint8_t row_lo(255), row_hi(0);
+
+    for(uint32_t y=0; y<height; y++)
+    {
+        img.get_constrained_row(x0, y0 + int32_t(y), width, channel, row);
+        for(uint32_t x=0; x<width; x++)
+        {
+            row_lo = (row[x] < row_lo) ? row[x] : row_lo;
+            row_hi = (row[x] > row_hi) ? row[x] : row_hi;
+        }
+        if(checksum)
+        {
+            for(uint32_t x=0; x<width; x++)
+            {
+                sum = (sum ^ row[x]) * 1099511628211ULL;
+            }
+        }
+    }
+    lo = row_lo;
+    hi = row_hi;
+    if(checksum)
+    {
+        *checksum = sum;
+    }
+}
+
+template <typename H>
+static void destroy_histogram(void *hist)
+{
+    delete (H *)hist;
+}
+
+template <uint32_t BINS, typename H>
+static void run_tile_jobs(tile_worker *worker)
+{
+    tile_scheduler &sched = *(worker->sched);
+    const filter_context<BINS> &ctx = *(const filter_context<BINS> *)sched.ctx;
+    const spectral::ImageView &source = sched.source;
+    const cached_source *cached = sched.cached;
+    H *hist(NULL);
+    uint8_t *pixels(NULL);
+    uint32_t job_index;
+    stats_timer timer;
+
+    uint32_t border_width, border_height;
+    uint32_t hist_width, hist_height;
+
+    // Histograms cover a tile plus the border of radius pixels on every
+    // side, which they read from the source directly.
+    border_width = sched.dest.get_width() + (sched.radius * 2);
+    border_height = sched.dest.get_height() + (sched.radius * 2);
+
+    // Every worker keeps a single histogram buffer, and only needs another
+    // when it hands one over to the cache.
+    hist_width = sched.tile_width + (sched.radius * 2);
+    hist_height = sched.tile_height + (sched.radius * 2);
+    if(hist_width > border_width)
+    {
+        hist_width = border_width;
+    }
+    if(hist_height > border_height)
+    {
+        hist_height = border_height;
+    }
+    pixels = new uint8_t[hist_width];
+
+    while(next_tile_job(sched, worker->id, job_index))
+    {
+        const tile_job &job = sched.jobs[job_index];
+        const H *tile_hist(NULL);
+        spectral::HistogramCache::Key key;
+        uint64_t checksum(0);
+        uint32_t xmax, ymax, first_bin, span;
+        uint8_t lo, hi;
+        int32_t x0, y0;
+
+        xmax = job.next_x + (sched.radius * 2);
+        ymax = job.next_y + (sched.radius * 2);
+        x0 = int32_t(job.x + sched.x_origin) - int32_t(sched.radius);
+        y0 = int32_t(job.y + sched.y_origin) - int32_t(sched.radius);
+
+        // Tiles of sky or backdrop often hold only a few values.  If they
+        // all share a bin there is no need for a histogram at all, and
+        // otherwise it need only cover the bins they span.
+        stats_begin(timer);
+        scan_region(source, x0, y0, xmax - job.x, ymax - job.y, job.channel,
+                    pixels, lo, hi, cached ? &checksum : NULL);
+        if(ctx.bin_map[lo] == ctx.bin_map[hi])
+        {
+            stats_lap(timer, STATS_BUILD);
+            filter_flat_tile(source, ctx, sched.radius,
+                             sched.x_origin, sched.y_origin, job.x, job.y,
+                             job.next_x - job.x, job.next_y - job.y,
+                             job.channel, lo, hi, sched.dest);
+            stats_lap(timer, STATS_FILTER);
+
+            finish_tile_job(worker, job);
+            continue;
+        }
+        H::get_span_for(lo, hi, first_bin, span);
+
+        if(cached)
+        {
+            key.id = cached->id;
+            key.x = cached->x + x0;
+            key.y = cached->y + y0;
+            key.width = xmax - job.x;
+            key.height = ymax - job.y;
+            key.channel = job.channel;
+            key.bins = BINS;
+            key.count_size = sizeof(*hist->get_buffer());
+            key.layout = H::get_layout();
+
+            tile_hist = (const H *)cached->cache->Acquire(key, checksum);
+        }
+        if(!tile_hist)
+        {
+            if(!hist)
+            {
+                hist = new H(hist_width, hist_height);
+            }
+            hist->Rebuild(source, x0, y0, xmax - job.x, ymax - job.y,
+                          job.channel, first_bin, span);
+            tile_hist = hist;
+        }
+        stats_lap(timer, STATS_BUILD);
+        filter_tile(tile_hist, source, ctx, sched.radius,
+                    sched.x_origin, sched.y_origin, job.x, job.y,
+                    job.next_x - job.x, job.next_y - job.y,
+                    job.channel, sched.dest);
+        stats_lap(timer, STATS_FILTER);
+
+        if(cached)
+        {
+            if(tile_hist != hist)
+            {
+                cached->cache->Release(tile_hist);
+            }
+            else if(cached->cache->Insert(key, checksum, hist, hist->get_bytes(),
+                                          destroy_histogram<H>))
+            {
+                hist = NULL;
+            }
+        }
+
+        finish_tile_job(worker, job);
+    }
+
+    delete [] pixels;
+    delete hist;
+}
+
+// Strips may be joint jobs, single channels, or a mix of both, so each kind
+// of histogram is only made once a job needs it.
+template <uint32_t BINS, typename J>
+static void run_strip_jobs(tile_worker *worker)
+{
+    tile_scheduler &sched = *(worker->sched);
+    const filter_context<BINS> &ctx = *(const filter_context<BINS> *)sched.ctx;
+    uint32_t max_width(sched.dest.get_width() + (sched.radius * 2));
+    spectral::sliding_histogram<BINS> *hist(NULL);
+    J *joint_hist(NULL);
+    uint32_t job_index;
+
+    while(next_tile_job(sched, worker->id, job_index))
+    {
+        const tile_job &job = sched.jobs[job_index];
+
+        if(job.joint)
+        {
+            if(!joint_hist)
+            {
+                joint_hist = new J(max_width);
+            }
+            filter_joint_strip(joint_hist, sched.source, ctx, sched.radius,
+                               sched.x_origin, sched.y_origin,
+                               job.x, job.y, job.next_x - job.x,
+                               job.next_y - job.y, sched.guide, sched.dest);
+        }
+        else
+        {
+            if(!hist)
+            {
+                hist = new spectral::sliding_histogram<BINS>(max_width);
+            }
+            filter_strip(hist, sched.source, ctx, sched.radius,
+                         sched.x_origin, sched.y_origin,
+                         job.x, job.y, job.next_x - job.x, job.next_y - job.y,
+                         job.channel, sched.dest);
+        }
+
+        finish_tile_job(worker, job);
+    }
+
+    delete joint_hist;
+    delete hist;
+}
+
+template <uint32_t BINS, typename H>
+static void run_stream_jobs(tile_worker *worker)
+{
+    tile_scheduler &sched = *(worker->sched);
+    const filter_context<BINS> &ctx = *(const filter_context<BINS> *)sched.ctx;
+    uint32_t window = (sched.radius * 2) + 1;
+    H hist(sched.stream_width + window - 1, window);
+    uint32_t job_index;
+
+    while(next_tile_job(sched, worker->id, job_index))
+    {
+        const tile_job &job = sched.jobs[job_index];
+
+        filter_stream(&hist, sched.source, ctx, sched.radius,
+                      sched.x_origin, sched.y_origin,
+                      job.x, job.y, job.next_x - job.x, job.next_y - job.y,
+                      job.channel, sched.dest);
+
+        finish_tile_job(worker, job);
+    }
+}
+
+template <uint32_t BINS>
+static void *tile_worker_main(void *data)
+{
+    tile_worker *worker = (tile_worker *)data;
+
+    if(worker->sched->engine == FILTER_ENGINE_SLIDING)
+    {
+        if(worker->sched->narrow_counts)
+        {
+            run_strip_jobs<BINS, spectral::joint_sliding_histogram<uint16_t, BINS> >(worker);
+        }
+        else
+        {
+            run_strip_jobs<BINS, spectral::joint_sliding_histogram<uint32_t, BINS> >(worker);
+        }
+    }
+    else if(worker->sched->engine == FILTER_ENGINE_STREAMING)
+    {
+        if(worker->sched->narrow_counts)
+        {
+            run_stream_jobs<BINS, spectral::rolling_integral_histogram<uint16_t, BINS> >(worker);
+        }
+        else
+        {
+            run_stream_jobs<BINS, spectral::rolling_integral_histogram<uint32_t, BINS> >(worker);
+        }
+    }
+    else if(worker->sched->slab_layout)
+    {
+        if(worker->sched->narrow_counts)
+        {
+            run_tile_jobs<BINS, spectral::slab_integral_histogram<uint16_t, BINS> >(worker);
+        }
+        else
+        {
+            run_tile_jobs<BINS, spectral::slab_integral_histogram<uint32_t, BINS> >(worker);
+        }
+    }
+    else if(worker->sched->narrow_counts)
+    {
+        run_tile_jobs<BINS, spectral::integral_histogram<uint16_t, BINS> >(worker);
+    }
+    else
+    {
+        run_tile_jobs<BINS, spectral::integral_histogram<uint32_t, BINS> >(worker);
+    }
+    stats_flush_thread();
+    return NULL;
+}
+
+const char *filter_engine_name(filter_engine engine)
+{
+    switch(engine)
+    {
+    case FILTER_ENGINE_INTEGRAL:
+        return "integral";
+    case FILTER_ENGINE_SLIDING:
+        return "sliding";
+    case FILTER_ENGINE_STREAMING:
+        return "streaming";
+    default:
+        return "auto";
+    }
+}
+
+const char *filter_guide_name(filter_guide guide)
+{
+    switch(guide)
+    {
+    case FILTER_GUIDE_LUMA:
+        return "luma";
+    case FILTER_GUIDE_RED:
+        return "red";
+    case FILTER_GUIDE_GREEN:
+        return "green";
+    case FILTER_GUIDE_BLUE:
+        return "blue";
+    default:
+        return "none";
+    }
+}
+
+const char *filter_alpha_name(filter_alpha alpha)
+{
+    switch(alpha)
+    {
+    case FILTER_ALPHA_FILTER:
+        return "filter";
+    case FILTER_ALPHA_PREMULTIPLIED:
+        return "premultiply";
+    default:
+        return "keep";
+    }
+}
+
+int filter_bins_supported(uint32_t num_bins)
+{
+    return (num_bins >= 8) && (num_bins <= 256) &&
+           !(num_bins & (num_bins - 1));
+}
+
+// Width of the output bands for the streaming engine, chosen so that the
+// ring of integral rows fits in STREAMING_RING_BYTES.  Returns 0 if the
+// window is too big for a worthwhile band.
+uint32_t get_stream_width(uint32_t radius, uint32_t num_bins, bool narrow_counts)
+{
+    size_t row_bytes;
+    uint32_t columns;
+
+    row_bytes = ((radius * 2) + 2) * num_bins;
+    row_bytes*= narrow_counts ? sizeof(uint16_t) : sizeof(uint32_t);
+    columns = STREAMING_RING_BYTES / row_bytes;
+
+    if(columns < (radius * 2) + STREAMING_MIN_WIDTH)
+    {
+        return 0;
+    }
+    return columns - (radius * 2);
+}
+
+// Whether the border around a tile is enough of its histogram that the
+// sliding engine, which has none, would do better.
+static bool tile_overlap_too_big(uint32_t tile_width, uint32_t tile_height,
+                                 uint32_t radius)
+{
+    uint64_t area, bordered;
+
+    area = uint64_t(tile_width) * tile_height;
+    bordered = uint64_t(tile_width + (radius * 2)) * (tile_height + (radius * 2));
+
+    return ((bordered - area) * SLIDING_OVERLAP_RATIO) >= bordered;
+}
+
+// The biggest tile whose histogram holds at most entries pixels.  For a given
+// amount of memory a square tile wastes the least on overlap, unless the
+// image is narrower than that, when the tiles become full width strips.
+static bool size_tile(size_t entries, uint32_t width, uint32_t height,
+                      uint32_t overlap,
+                      uint32_t &tile_width, uint32_t &tile_height)
+{
+    uint32_t side = uint32_t(sqrt(double(entries)));
+
+    if(side <= overlap)
+    {
+        return false;
+    }
+    tile_width = side - overlap;
+    if(tile_width > width)
+    {
+        tile_width = width;
+    }
+    tile_height = entries / (tile_width + overlap);
+    if(tile_height <= overlap)
+    {
+        return false;
+    }
+    tile_height-= overlap;
+    if(tile_height > height)
+    {
+        tile_height = height;
+    }
+    return true;
+}
+
+bool get_tile_geometry(uint32_t width, uint32_t height, uint32_t channels,
+                       uint32_t radius, uint32_t num_bins, uint32_t tile_size,
+                       uint32_t num_threads, bool grow,
+                       uint32_t &tile_width, uint32_t &tile_height)
+{
+    uint32_t overlap(radius * 2), window(overlap + 1), workers;
+    uint32_t tiles_x, tiles_y;
+    size_t share, entries, entry_size;
+    bool result;
+
+    if(tile_size)
+    {
+        if(overlap >= tile_size)
+        {
+            return false;
+        }
+        tile_width = tile_height = tile_size - overlap;
+        return true;
+    }
+
+    workers = get_num_threads(num_threads);
+    entry_size = num_bins * (((window * window) <= 0xffff) ? sizeof(uint16_t)
+                                                           : sizeof(uint32_t));
+    share = TILE_MEMORY_BYTES / workers;
+    entries = ((share < TILE_WORKER_BYTES) ? share : TILE_WORKER_BYTES) / entry_size;
+
+    // Big windows may get tiles past TILE_WORKER_BYTES rather than too much
+    // overlap, as long as the workers' share allows.
+    result = size_tile(entries, width, height, overlap, tile_width, tile_height);
+    if(grow && (!result || tile_overlap_too_big(tile_width, tile_height, radius)) &&
+            ((share / entry_size) > entries))
+    {
+        result = size_tile(share / entry_size, width, height, overlap,
+                           tile_width, tile_height);
+    }
+    if(!result)
+    {
+        return false;
+    }
+
+    // Give every worker a job, by cutting the tiles into shorter ones, as
+    // long as that doesn't make them shorter than their overlap.
+    tiles_x = (width + tile_width - 1) / tile_width;
+    tiles_y = (height + tile_height - 1) / tile_height;
+    if((tiles_x * tiles_y * channels) < workers)
+    {
+        uint32_t rows = (workers + (tiles_x * channels) - 1) / (tiles_x * channels);
+        uint32_t split = (height + rows - 1) / rows;
+
+        if(split < overlap)
+        {
+            split = overlap;
+        }
+        if(split < tile_height)
+        {
+            tile_height = split;
+        }
+    }
+    return true;
+}
+
+// Whether at least 1/NARROW_TILE_RATIO of the (tile, channel) pairs of dest
+// are flat or hold values that span at most 1/NARROW_SPAN_RATIO of the bins,
+// going by every NARROW_SCAN_STEP'th row of them and their borders.  It skips such tiles
+// or builds only the bins they use, which the sliding engine cannot.
+template <uint32_t BINS>
+static bool mostly_narrow(const spectral::ImageView &source,
+                          uint32_t x_origin, uint32_t y_origin,
+                          uint32_t width, uint32_t height, uint32_t channels,
+                          uint32_t radius,
+                          uint32_t tile_width, uint32_t tile_height,
+                          const filter_context<BINS> &ctx)
+{
+    uint32_t tiles_x = (width + tile_width - 1) / tile_width;
+    uint32_t tiles_y = (height + tile_height - 1) / tile_height;
+    uint32_t total = tiles_x * tiles_y * channels;
+    uint32_t narrow(0), wide(0);
+    uint8_t *row = new uint8_t[tile_width + (radius * 2)];
+
+    for(uint32_t y=0; y<height; y+=tile_height)
+    {
+        uint32_t h = ((y + tile_height) < height) ? tile_height : (height - y);
+
+        for(uint32_t x=0; x<width; x+=tile_width)
+        {
+            uint32_t w = ((x + tile_width) < width) ? tile_width : (width - x);
+
+            for(uint32_t c=0; c<channels; c++)
+            {
+                uint8_t lo(255), hi(0);
+
+                for(uint32_t r=0; r<h + (radius * 2); r+=NARROW_SCAN_STEP)
+                {
+                    source.get_constrained_row(int32_t(x + x_origin) - int32_t(radius),
+                                               int32_t(y + y_origin + r) - int32_t(radius),
+                                               w + (radius * 2), c, row);
+                    for(uint32_t i=0; i<w + (radius * 2); i++)
+                    {
+                        lo = (row[i] < lo) ? row[i] : lo;
+                        hi = (row[i] > hi) ? row[i] : hi;
+                    }
+                }
+                if(((ctx.bin_map[hi] - ctx.bin_map[lo] + 1) *
+                        NARROW_SPAN_RATIO) <= BINS)
+                {
+                    narrow++;
+                }
+                else
+                {
+                    wide++;
+                }
+
+                // Stop as soon as the answer is known.
+                if((narrow * NARROW_TILE_RATIO) >= total)
+                {
+                    delete [] row;
+                    return true;
+                }
+                if(((total - wide) * NARROW_TILE_RATIO) < total)
+                {
+                    delete [] row;
+                    return false;
+                }
+            }
+        }
+    }
+    delete [] row;
+    return false;
+}
+
+// Read all of source through reader, a band at a time, letting progress
+// cancel between bands.  Returns false if it did.
+static bool read_source(const source_reader *reader, spectral::Image *source,
+                        filter_progress_fun progress, void *progress_data)
+{
+    uint32_t band_height(reader->band_height);
+    stats_timer timer;
+
+    if(!band_height)
+    {
+        band_height = source->get_height();
+    }
+    for(uint32_t y0=0; y0<source->get_height(); y0+=band_height)
+    {
+        uint32_t y1 = y0 + band_height;
+
+        if(y1 > source->get_height())
+        {
+            y1 = source->get_height();
+        }
+        stats_begin(timer);
+        reader->read_rows(reader->data, y0, y1, source);
+        stats_lap(timer, STATS_READ);
+
+        if(progress && !progress(progress_data, 0.0))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Pick an engine for FILTER_ENGINE_AUTO.  The streaming engine is never
+// picked, as "make bench" has yet to find a case where it beats both of the
+// others.  Integral histograms are built over overlapping tiles, so they lose
+// out once the overlap gets large, and cannot be used at all if tile_width is
+// 0, when no tile can hold a window.  They are the only histograms that can
+// be cached though, so with a cache they are used whatever the overlap, as
+// the next run over the same pixels can then skip building them.  Big images
+// also stay on them if narrow is set, as mostly_narrow found the tiles cheap.
+filter_engine choose_filter_engine(filter_engine requested,
+                                   uint32_t width, uint32_t height,
+                                   uint32_t radius,
+                                   uint32_t tile_width, uint32_t tile_height,
+                                   bool cached, bool narrow)
+{
+    filter_engine result(requested);
+
+    if(result != FILTER_ENGINE_INTEGRAL &&
+            result != FILTER_ENGINE_SLIDING &&
+            result != FILTER_ENGINE_STREAMING)
+    {
+        if(cached)
+        {
+            result = FILTER_ENGINE_INTEGRAL;
+        }
+        else if(tile_overlap_too_big(tile_width, tile_height, radius) ||
+                (((width * height) >= SLIDING_MIN_PIXELS) && !narrow))
+        {
+            result = FILTER_ENGINE_SLIDING;
+        }
+        else
+        {
+            result = FILTER_ENGINE_INTEGRAL;
+        }
+    }
+    if((result == FILTER_ENGINE_INTEGRAL) && !tile_width)
+    {
+        result = FILTER_ENGINE_SLIDING;
+    }
+    return result;
+}
+
+// Filter every channel of every tile of the image, spreading the
+// (tile, channel) pairs over a pool of worker threads.  Each pair writes to
+// its own bytes of dest, so the output does not depend on the thread count.
+// The sliding engine works on full width strips rather than square tiles.
+// If reader is given, source starts out empty and this thread reads it in
+// bands while the workers filter the rows that have arrived, unless auto mode
+// has to scan it to pick an engine, when it is all read first.  dest may cover
+// just part of source, starting at (x_origin, y_origin), in which case the
+// rest of source is only used as the surroundings of dest's pixels.
+// With a guide, the colour channels of each strip are one job, on the sliding
+// engine, which is the only one with joint histograms.  Only the first
+// channels channels of dest are filtered, and any others are left alone.
+// If enhance is given, its max is set to the largest enhanced value in dest.
+// Returns false if progress cancelled the filter.
+template <uint32_t BINS>
+bool tile_and_filter(spectral::Image *source,
+                     const source_reader *reader,
+                     uint32_t x_origin,
+                     uint32_t y_origin,
+                     const filter_context<BINS> &ctx,
+                     uint32_t tile_size,
+                     uint32_t radius,
+                     uint32_t num_threads,
+                     filter_engine engine,
+                     filter_guide guide,
+                     uint32_t channels,
+                     const cached_source *cached,
+                     enhance_state *enhance,
+                     filter_progress_fun progress,
+                     void *progress_data,
+                     spectral::Image *dest)
+{
+    typedef spectral::joint_histogram_base joint_histogram;
+    uint32_t tile_width, tile_height;
+    uint32_t x, y, joint_channels;
+    tile_scheduler sched;
+    tile_worker *workers;
+    pthread_t *threads;
+    uint32_t num_started(0);
+    bool narrow;
+
+    {
+        uint32_t window = (radius * 2) + 1;
+        sched.narrow_counts = (window * window) <=
+                              spectral::integral_histogram<uint16_t, BINS>::max_window_area();
+
+        // Windows too big for the joint sums are filtered a channel at a
+        // time instead.
+        if((channels < uint32_t(joint_histogram::CHANNELS)) ||
+                ((window * window) > joint_histogram::max_window_area()))
+        {
+            guide = FILTER_GUIDE_NONE;
+        }
+    }
+    joint_channels = 0;
+    switch(guide)
+    {
+    case FILTER_GUIDE_LUMA:
+        sched.guide = joint_histogram::LUMA;
+        break;
+    case FILTER_GUIDE_RED:
+    case FILTER_GUIDE_GREEN:
+    case FILTER_GUIDE_BLUE:
+        sched.guide = guide - FILTER_GUIDE_RED;
+        break;
+    default:
+        guide = FILTER_GUIDE_NONE;
+        sched.guide = 0;
+        break;
+    }
+    if(guide != FILTER_GUIDE_NONE)
+    {
+        engine = FILTER_ENGINE_SLIDING;
+        joint_channels = joint_histogram::CHANNELS;
+    }
+
+    if(cached)
+    {
+        cached->cache->StartPass();
+    }
+
+    sched.slab_layout = (ctx.widest_slabs * filter_context<BINS>::SLAB *
+                         SLAB_LAYOUT_RATIO) <= BINS;
+    sched.stream_width = get_stream_width(radius, BINS, sched.narrow_counts);
+    // Only a request for the integral engine grows tiles past
+    // TILE_WORKER_BYTES; otherwise a window needing that much overlap goes
+    // to the sliding engine, which does the same job in a few mb.  Tiles
+    // that are to be cached never grow, so that each fits in the cache.
+    if(!get_tile_geometry(dest->get_width(), dest->get_height(),
+                          channels - joint_channels + (joint_channels ? 1 : 0),
+                          radius, BINS, tile_size, num_threads,
+                          (engine == FILTER_ENGINE_INTEGRAL) && !cached,
+                          tile_width, tile_height))
+    {
+        tile_width = tile_height = 0;
+    }
+    // Big images are only scanned if their size alone would send them to
+    // the sliding engine.  The scan needs every pixel, so a reader then
+    // fills source up front, giving up the overlap of reading with filtering
+    // for the engine that suits the pixels.
+    narrow = (engine == FILTER_ENGINE_AUTO) && !cached && tile_width &&
+             ((dest->get_width() * dest->get_height()) >= SLIDING_MIN_PIXELS) &&
+             !tile_overlap_too_big(tile_width, tile_height, radius);
+    if(narrow && reader)
+    {
+        if(!read_source(reader, source, progress, progress_data))
+        {
+            return false;
+        }
+        reader = NULL;
+    }
+    narrow = narrow &&
+             mostly_narrow(*source, x_origin, y_origin,
+                           dest->get_width(), dest->get_height(),
+                           channels - joint_channels, radius,
+                           tile_width, tile_height, ctx);
+    sched.engine = choose_filter_engine(engine,
+                                        dest->get_width(), dest->get_height(),
+                                        radius, tile_width, tile_height,
+                                        cached != NULL, narrow);
+    if(sched.engine == FILTER_ENGINE_SLIDING)
+    {
+        tile_width = dest->get_width();
+        tile_height = SLIDING_STRIP_HEIGHT;
+    }
+    else if(sched.engine == FILTER_ENGINE_STREAMING)
+    {
+        if(sched.stream_width < STREAMING_MIN_WIDTH)
+        {
+            sched.stream_width = STREAMING_MIN_WIDTH;
+        }
+        tile_width = sched.stream_width;
+        tile_height = STREAMING_BAND_HEIGHT;
+    }
+
+    sched.source = *source;
+    sched.ctx = &ctx;
+    sched.dest = *dest;
+    sched.cached = cached;
+    sched.joint_channels = joint_channels;
+    sched.enhance = enhance != NULL;
+    sched.contrast = enhance ? enhance->contrast : 0;
+    sched.x_origin = x_origin;
+    sched.y_origin = y_origin;
+    sched.tile_width = tile_width;
+    sched.tile_height = tile_height;
+    sched.radius = radius;
+    sched.num_jobs = ((dest->get_width() / tile_width) + 1) *
+                     ((dest->get_height() / tile_height) + 1) *
+                     (channels - joint_channels + 1);
+    sched.jobs = new tile_job[sched.num_jobs];
+    sched.jobs_done = 0;
+
+    // Build the job list, keeping the channels of a tile together.
+    sched.num_jobs = 0;
+    y = 0;
+    do
+    {
+        uint32_t next_y;
+
+        next_y = y + tile_height;
+
+        if(next_y > dest->get_height())
+        {
+            next_y = dest->get_height();
+        }
+
+        x = 0;
+        do
+        {
+            uint32_t next_x;
+
+            next_x = x + tile_width;
+
+            if(next_x > dest->get_width())
+            {
+                next_x = dest->get_width();
+            }
+
+            if(joint_channels)
+            {
+                tile_job &job = sched.jobs[sched.num_jobs++];
+                job.x = x;
+                job.y = y;
+                job.next_x = next_x;
+                job.next_y = next_y;
+                job.channel = 0;
+                job.joint = true;
+            }
+            for(uint32_t i=joint_channels; i<channels; i++)
+            {
+                tile_job &job = sched.jobs[sched.num_jobs++];
+                job.x = x;
+                job.y = y;
+                job.next_x = next_x;
+                job.next_y = next_y;
+                job.channel = i;
+                job.joint = false;
+            }
+
+            x = next_x;
+        }
+        while(x < dest->get_width());
+        y = next_y;
+
+    }
+    while(y < dest->get_height());
+
+    sched.num_workers = get_num_threads(num_threads);
+    if(sched.num_workers > sched.num_jobs)
+    {
+        sched.num_workers = sched.num_jobs;
+    }
+
+    sched.ranges = new job_range[sched.num_workers];
+    for(uint32_t i=0; i<sched.num_workers; i++)
+    {
+        sched.ranges[i].first = (i * sched.num_jobs) / sched.num_workers;
+        sched.ranges[i].last = ((i + 1) * sched.num_jobs) / sched.num_workers;
+    }
+
+    sched.rows_ready = reader ? 0 : source->get_height();
+    sched.cancelled = false;
+
+    stats_set_run(filter_engine_name(sched.engine), sched.num_workers,
+                  sched.num_jobs);
+
+    pthread_mutex_init(&sched.mutex, NULL);
+    pthread_cond_init(&sched.done_cond, NULL);
+    pthread_cond_init(&sched.ready_cond, NULL);
+
+    workers = new tile_worker[sched.num_workers];
+    threads = new pthread_t[sched.num_workers];
+
+    for(uint32_t i=0; i<sched.num_workers; i++)
+    {
+        workers[i].sched = &sched;
+        workers[i].id = i;
+        workers[i].enhance_max = 0;
+        if(pthread_create(&threads[num_started], NULL,
+                          tile_worker_main<BINS>, &workers[i]) == 0)
+        {
+            num_started++;
+        }
+    }
+
+    if(reader)
+    {
+        // Without workers to overlap with, the whole image is read up front.
+        uint32_t band_height(num_started ? reader->band_height : 0);
+        uint32_t y0(0), done;
+        stats_timer timer;
+
+        if(!band_height)
+        {
+            band_height = source->get_height();
+        }
+        while(y0 < source->get_height())
+        {
+            uint32_t y1 = y0 + band_height;
+
+            if(y1 > source->get_height())
+            {
+                y1 = source->get_height();
+            }
+            stats_begin(timer);
+            reader->read_rows(reader->data, y0, y1, source);
+            stats_lap(timer, STATS_READ);
+
+            pthread_mutex_lock(&sched.mutex);
+            sched.rows_ready = y1;
+            pthread_cond_broadcast(&sched.ready_cond);
+            done = sched.jobs_done;
+            pthread_mutex_unlock(&sched.mutex);
+
+            // As below, progress is called without the lock, so that the
+            // workers can carry on while it draws.
+            if(progress &&
+                    !progress(progress_data, (double)done/(double)sched.num_jobs))
+            {
+                pthread_mutex_lock(&sched.mutex);
+                cancel_tile_jobs(sched);
+                pthread_mutex_unlock(&sched.mutex);
+                break;
+            }
+            y0 = y1;
+        }
+    }
+
+    if(num_started)
+    {
+        // Progress is reported from this thread, which is the one the caller
+        // expects it on, while the workers crunch.
+        uint32_t reported(0);
+
+        pthread_mutex_lock(&sched.mutex);
+        while((reported < sched.num_jobs) && !sched.cancelled)
+        {
+            while(sched.jobs_done == reported)
+            {
+                pthread_cond_wait(&sched.done_cond, &sched.mutex);
+            }
+            reported = sched.jobs_done;
+
+            pthread_mutex_unlock(&sched.mutex);
+            if(progress &&
+                    !progress(progress_data,
+                              (double)reported/(double)sched.num_jobs))
+            {
+                pthread_mutex_lock(&sched.mutex);
+                cancel_tile_jobs(sched);
+                pthread_mutex_unlock(&sched.mutex);
+            }
+            pthread_mutex_lock(&sched.mutex);
+        }
+        pthread_mutex_unlock(&sched.mutex);
+
+        for(uint32_t i=0; i<num_started; i++)
+        {
+            pthread_join(threads[i], NULL);
+        }
+    }
+    else
+    {
+        // No threads available, so do all the work here.  Worker 0 steals
+        // everything from the others.
+        if(!sched.cancelled)
+        {
+            tile_worker_main<BINS>(&workers[0]);
+            if(progress)
+            {
+                progress(progress_data, 1.0);
+            }
+        }
+    }
+
+    if(enhance)
+    {
+        enhance->max = 0;
+        for(uint32_t i=0; i<sched.num_workers; i++)
+        {
+            if(workers[i].enhance_max > enhance->max)
+            {
+                enhance->max = workers[i].enhance_max;
+            }
+        }
+    }
+
+    pthread_cond_destroy(&sched.ready_cond);
+    pthread_cond_destroy(&sched.done_cond);
+    pthread_mutex_destroy(&sched.mutex);
+
+    delete [] threads;
+    delete [] workers;
+    delete [] sched.ranges;
+    delete [] sched.jobs;
+
+    // Released histograms are only worth keeping within a run, so that
+    // nothing stays resident between them.
+    spectral::drain_histogram_allocator();
+
+    return !sched.cancelled;
+}
+
+// Filter the whole image using BINS histogram bins.
+template <uint32_t BINS>
+bool filter_image(spectral::Image *source,
+                  const source_reader *reader,
+                  uint32_t x_origin,
+                  uint32_t y_origin,
+                  uint32_t radius,
+                  uint32_t threshold,
+                  bool use_linear,
+                  uint32_t tile_size,
+                  uint32_t num_threads,
+                  filter_engine engine,
+                  filter_guide guide,
+                  uint32_t channels,
+                  const cached_source *cached,
+                  enhance_state *enhance,
+                  filter_progress_fun progress,
+                  void *progress_data,
+                  spectral::Image *dest)
+{
+    filter_context<BINS> *ctx = new filter_context<BINS>;
+    bool result;
+
+    initialise_filter_context(threshold, !use_linear, *ctx);
+
+    result = tile_and_filter(source, reader, x_origin, y_origin, *ctx,
+                             tile_size, radius, num_threads, engine, guide,
+                             channels, cached, enhance, progress, progress_data,
+                             dest);
+
+    delete ctx;
+    return result;
+}
+
+// Pick the filter_image instance for a bin count chosen at runtime.  Returns
+// false for counts that have none.
+static bool run_filter_image(uint32_t num_bins,
+                             spectral::Image *source,
+                             const source_reader *reader,
+                             uint32_t x_origin,
+                             uint32_t y_origin,
+                             uint32_t radius,
+                             uint32_t threshold,
+                             bool use_linear,
+                             uint32_t tile_size,
+                             uint32_t num_threads,
+                             filter_engine engine,
+                             filter_guide guide,
+                             uint32_t channels,
+                             const cached_source *cached,
+                             enhance_state *enhance,
+                             filter_progress_fun progress,
+                             void *progress_data,
+                             spectral::Image *dest)
+{
+    bool result(false);
+
+    switch(num_bins)
+    {
+    case 8:
+        result = filter_image<8>(source, reader, x_origin, y_origin,
+                                 radius, threshold, use_linear, tile_size,
+                                 num_threads, engine, guide, channels,
+                                 cached, enhance, progress, progress_data, dest);
+        break;
+    case 16:
+        result = filter_image<16>(source, reader, x_origin, y_origin,
+                                  radius, threshold, use_linear, tile_size,
+                                  num_threads, engine, guide, channels,
+                                  cached, enhance, progress, progress_data, dest);
+        break;
+    case 32:
+        result = filter_image<32>(source, reader, x_origin, y_origin,
+                                  radius, threshold, use_linear, tile_size,
+                                  num_threads, engine, guide, channels,
+                                  cached, enhance, progress, progress_data, dest);
+        break;
+    case 128:
+        result = filter_image<128>(source, reader, x_origin, y_origin,
+                                   radius, threshold, use_linear, tile_size,
+                                   num_threads, engine, guide, channels,
+                                   cached, enhance, progress, progress_data, dest);
+        break;
+    case 256:
+        result = filter_image<256>(source, reader, x_origin, y_origin,
+                                   radius, threshold, use_linear, tile_size,
+                                   num_threads, engine, guide, channels,
+                                   cached, enhance, progress, progress_data, dest);
+        break;
+    case 64:
+        result = filter_image<64>(source, reader, x_origin, y_origin,
+                                  radius, threshold, use_linear, tile_size,
+                                  num_threads, engine, guide, channels,
+                                  cached, enhance, progress, progress_data, dest);
+        break;
+    default:
+        break;
+    }
+    return result;
+}
+
+// Whether an image's last channel is alpha, as it is for gimp's GRAYA and
+// RGBA drawables.
+static bool has_alpha(const spectral::Image *img)
+{
+    return (img->get_channels() == 2) || (img->get_channels() == 4);
+}
+
+// Colour channels multiplied by alpha, rounded to the nearest.
+static void premultiply_rows(const spectral::Image &source, uint32_t y0,
+                             uint32_t y1, spectral::Image *dest)
+{
+    uint32_t channels(source.get_channels()), alpha(channels - 1);
+    const uint8_t *in;
+    uint8_t *out;
+
+    in = source.get_buffer() + ((size_t)y0 * source.get_width() * channels);
+    out = dest->get_buffer() + ((size_t)y0 * dest->get_width() * channels);
+
+    for(size_t i=0; i<((size_t)(y1 - y0) * source.get_width()); i++)
+    {
+        for(uint32_t c=0; c<alpha; c++)
+        {
+            out[c] = ((in[c] * in[alpha]) + 127) / 255;
+        }
+        out[alpha] = in[alpha];
+        in+= channels;
+        out+= channels;
+    }
+}
+
+// The reverse of premultiply_rows, over the whole image.  Where nothing is
+// left of the alpha there is no colour either.
+static void unpremultiply_image(spectral::Image *img)
+{
+    uint32_t channels(img->get_channels()), alpha(channels - 1);
+    uint8_t *pixel(img->get_buffer());
+
+    for(size_t i=0; i<((size_t)img->get_width() * img->get_height()); i++)
+    {
+        uint32_t a(pixel[alpha]);
+
+        for(uint32_t c=0; c<alpha; c++)
+        {
+            uint32_t value = a ? (((pixel[c] * 255) + (a / 2)) / a) : 0;
+
+            pixel[c] = (value > 255) ? 255 : value;
+        }
+        pixel+= channels;
+    }
+}
+
+// Copy the alpha of the part of source at (x_origin, y_origin) into dest.
+static void copy_alpha(const spectral::Image *source,
+                       uint32_t x_origin, uint32_t y_origin,
+                       spectral::Image *dest)
+{
+    uint32_t channels(dest->get_channels()), alpha(channels - 1);
+
+    for(uint32_t y=0; y<dest->get_height(); y++)
+    {
+        const uint8_t *in;
+        uint8_t *out;
+
+        in = source->get_buffer() + alpha +
+             (((y + y_origin) * source->get_width()) + x_origin) * channels;
+        out = dest->get_buffer() + alpha + (y * dest->get_width() * channels);
+
+        for(uint32_t x=0; x<dest->get_width(); x++)
+        {
+            *out = *in;
+            in+= channels;
+            out+= channels;
+        }
+    }
+}
+
+// Premultiplies the rows of the source as they are read, into a copy which
+// the filter works from.
+typedef struct _premultiplied_reader
+{
+    const source_reader *reader;
+    spectral::Image *source;
+} premultiplied_reader;
+
+static void read_premultiplied_rows(void *data, uint32_t y0, uint32_t y1,
+                                    spectral::Image *img)
+{
+    const premultiplied_reader *premultiplied = (const premultiplied_reader *)data;
+    const source_reader *reader = premultiplied->reader;
+
+    reader->read_rows(reader->data, y0, y1, premultiplied->source);
+    premultiply_rows(*premultiplied->source, y0, y1, img);
+}
+
+// run_filter_image, with alpha treated as alpha says.  When enhancing with
+// premultiplied alpha, the largest enhanced value cannot be found as the
+// filter runs, as the filter only sees premultiplied colours, so it is found
+// afterwards.
+static bool run_filter_alpha(uint32_t num_bins,
+                             spectral::Image *source,
+                             const source_reader *reader,
+                             uint32_t x_origin,
+                             uint32_t y_origin,
+                             uint32_t radius,
+                             uint32_t threshold,
+                             bool use_linear,
+                             uint32_t tile_size,
+                             uint32_t num_threads,
+                             filter_engine engine,
+                             filter_guide guide,
+                             filter_alpha alpha,
+                             const cached_source *cached,
+                             enhance_state *enhance,
+                             filter_progress_fun progress,
+                             void *progress_data,
+                             spectral::Image *dest)
+{
+    uint32_t channels(dest->get_channels());
+    spectral::Image *premultiplied;
+    premultiplied_reader state;
+    source_reader premultiplied_source;
+    stats_timer timer;
+    bool result;
+
+    if(!has_alpha(dest) || (alpha == FILTER_ALPHA_FILTER))
+    {
+        return run_filter_image(num_bins, source, reader, x_origin, y_origin,
+                                radius, threshold, use_linear, tile_size,
+                                num_threads, engine, guide, channels, cached,
+                                enhance, progress, progress_data, dest);
+    }
+
+    if(alpha != FILTER_ALPHA_PREMULTIPLIED)
+    {
+        // Alpha is left out of the jobs altogether, and copied across.
+        result = run_filter_image(num_bins, source, reader, x_origin, y_origin,
+                                  radius, threshold, use_linear, tile_size,
+                                  num_threads, engine, guide, channels - 1,
+                                  cached, enhance, progress, progress_data,
+                                  dest);
+        if(result)
+        {
+            copy_alpha(source, x_origin, y_origin, dest);
+        }
+        return result;
+    }
+
+    premultiplied = new spectral::Image(source->get_width(), source->get_height(),
+                                        channels);
+    if(reader)
+    {
+        state.reader = reader;
+        state.source = source;
+        premultiplied_source.read_rows = read_premultiplied_rows;
+        premultiplied_source.data = &state;
+        premultiplied_source.band_height = reader->band_height;
+        reader = &premultiplied_source;
+    }
+    else
+    {
+        stats_begin(timer);
+        premultiply_rows(*source, 0, source->get_height(), premultiplied);
+        stats_lap(timer, STATS_READ);
+    }
+
+    result = run_filter_image(num_bins, premultiplied, reader,
+                              x_origin, y_origin, radius, threshold, use_linear,
+                              tile_size, num_threads, engine, guide, channels,
+                              cached, NULL, progress, progress_data, dest);
+    if(result)
+    {
+        stats_begin(timer);
+        unpremultiply_image(dest);
+        stats_lap(timer, STATS_FILTER);
+        if(enhance)
+        {
+            enhance->max = get_enhanced_max(*source, x_origin, y_origin, *dest,
+                                            0, 0, dest->get_width(),
+                                            dest->get_height(), 0, channels,
+                                            enhance->contrast);
+            stats_lap(timer, STATS_ENHANCE);
+        }
+    }
+
+    delete premultiplied;
+    return result;
+}
+
+bool filter_image_with_bins(uint32_t num_bins,
+                            spectral::Image *source,
+                            const source_reader *reader,
+                            uint32_t x_origin,
+                            uint32_t y_origin,
+                            uint32_t radius,
+                            uint32_t threshold,
+                            bool use_linear,
+                            uint32_t tile_size,
+                            uint32_t num_threads,
+                            filter_engine engine,
+                            filter_guide guide,
+                            filter_alpha alpha,
+                            const cached_source *cached,
+                            filter_progress_fun progress,
+                            void *progress_data,
+                            spectral::Image *dest)
+{
+    if(!filter_bins_supported(num_bins))
+    {
+        return false;
+    }
+    return run_filter_alpha(num_bins, source, reader, x_origin, y_origin,
+                            radius, threshold, use_linear, tile_size,
+                            num_threads, engine, guide, alpha, cached, NULL,
+                            progress, progress_data, dest);
+}
+
+bool enhance_image_with_bins(uint32_t num_bins,
+                             spectral::Image *source,
+                             const source_reader *reader,
+                             uint32_t x_origin,
+                             uint32_t y_origin,
+                             uint32_t radius,
+                             uint32_t threshold,
+                             bool use_linear,
+                             uint32_t tile_size,
+                             uint32_t num_threads,
+                             filter_engine engine,
+                             filter_guide guide,
+                             filter_alpha alpha,
+                             const cached_source *cached,
+                             float contrast,
+                             filter_progress_fun progress,
+                             void *progress_data,
+                             spectral::Image *dest)
+{
+    enhance_state enhance;
+    stats_timer timer;
+    uint32_t channels(dest->get_channels()), enhanced(channels);
+    float scale;
+
+    if(!filter_bins_supported(num_bins))
+    {
+        return false;
+    }
+
+    enhance.contrast = contrast;
+    enhance.max = 0;
+    if(!run_filter_alpha(num_bins, source, reader, x_origin, y_origin,
+                         radius, threshold, use_linear, tile_size,
+                         num_threads, engine, guide, alpha, cached, &enhance,
+                         progress, progress_data, dest))
+    {
+        return false;
+    }
+
+    // Alpha that was kept as it is stays that way.
+    if(has_alpha(dest) && (alpha == FILTER_ALPHA_KEEP))
+    {
+        enhanced = channels - 1;
+    }
+
+    // Scale the enhanced values down so that the largest one is 255, writing
+    // them over the filtered values they came from.
+    stats_begin(timer);
+    scale = (enhance.max > 255) ? (enhance.max / 255) : 1;
+    for(uint32_t y=0; y<dest->get_height(); y++)
+    {
+        const uint8_t *in;
+        uint8_t *out;
+
+        in = source->get_buffer() +
+             (((y + y_origin) * source->get_width()) + x_origin) * channels;
+        out = dest->get_buffer() + (y * dest->get_width() * channels);
+
+        for(uint32_t x=0; x<dest->get_width(); x++)
+        {
+            for(uint32_t c=0; c<enhanced; c++)
+            {
+                int32_t value;
+
+                value = trunc(enhance_sample(in[c], out[c], contrast) / scale);
+                if(value > 255)
+                {
+                    value = 255;
+                }
+                if(value < 0)
+                {
+                    value = 0;
+                }
+                out[c] = value;
+            }
+            in+= channels;
+            out+= channels;
+        }
+    }
+    stats_lap(timer, STATS_ENHANCE);
+
+    return true;
+}
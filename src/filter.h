@@ -0,0 +1,158 @@
+#ifndef __FILTER_H__
+#define __FILTER_H__
+#include <stdint.h>
+
+// The filter engine itself.  Nothing here depends on gimp, so that it can be
+// built into a library and driven from the plug-in or from the command line.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+    // How window histograms are produced.  Both give the same output.
+    typedef enum
+    {
+        FILTER_ENGINE_AUTO,
+        FILTER_ENGINE_INTEGRAL,     // integral histograms over square tiles
+        FILTER_ENGINE_SLIDING,      // sliding column histograms over strips
+        FILTER_ENGINE_STREAMING     // rolling integral rows over bands
+    } filter_engine;
+
+    // What the weights for the colour channels of an RGB image are taken
+    // from.  With a guide, red, green and blue are all averaged with the same
+    // weights, found by comparing guide values, so an edge cannot smooth one
+    // channel and not another and leave a coloured fringe.  Any other
+    // channels, and images with fewer than three, are filtered a channel at a
+    // time whatever the guide.
+    typedef enum
+    {
+        FILTER_GUIDE_NONE,          // each channel weighted by its own values
+        FILTER_GUIDE_LUMA,
+        FILTER_GUIDE_RED,
+        FILTER_GUIDE_GREEN,
+        FILTER_GUIDE_BLUE
+    } filter_guide;
+
+    // What happens to the alpha of images with two or four channels, which
+    // as in gimp is taken to be the last one.  Kept alpha is copied from the
+    // source and costs nothing.  Premultiplied filtering weights each pixel's
+    // colour by its alpha, so that the colour of transparent pixels does not
+    // bleed into the rest, and filters alpha too.
+    typedef enum
+    {
+        FILTER_ALPHA_KEEP,
+        FILTER_ALPHA_FILTER,        // filtered like any other channel
+        FILTER_ALPHA_PREMULTIPLIED
+    } filter_alpha;
+
+    // Whether there are kernels for num_bins bins: a power of two from 8 to
+    // 256.
+    int filter_bins_supported(uint32_t num_bins);
+#ifdef __cplusplus
+}
+
+#include "image.h"
+#include "histogram_cache.h"
+
+// "auto", "integral", "sliding" or "streaming".
+const char *filter_engine_name(filter_engine engine);
+
+// "none", "luma", "red", "green" or "blue".
+const char *filter_guide_name(filter_guide guide);
+
+// "keep", "filter" or "premultiply".
+const char *filter_alpha_name(filter_alpha alpha);
+
+// Called on the thread that started the filter with the fraction of the work
+// done so far.  Returning false cancels the filter, which then stops as soon
+// as the jobs already running have finished.
+typedef bool (*filter_progress_fun)(void *data, double progress);
+
+// Supplies the rows of the source image in order while it is being filtered,
+// so that reading the next band overlaps with filtering the ones before it.
+typedef struct _source_reader
+{
+    // Fill in rows y0 to y1 - 1 of img.
+    void (*read_rows)(void *data, uint32_t y0, uint32_t y1, spectral::Image *img);
+    void *data;
+    uint32_t band_height;
+} source_reader;
+
+// Lets the integral engine keep the histograms it builds in cache, so that a
+// later call on the same pixels, say with only the threshold changed, skips
+// building them.  id names the image that source was taken from, and (x, y)
+// is where source lies within it, so histograms carry over between calls that
+// read different parts of the same image.
+typedef struct _cached_source
+{
+    spectral::HistogramCache *cache;
+    int32_t id;
+    int32_t x, y;
+} cached_source;
+
+// Size of the tiles of dest that the integral engine filters, not counting
+// the border of radius pixels that their histograms also cover.  A tile_size
+// of 0 sizes them from TILE_MEMORY_BYTES and TILE_WORKER_BYTES, the bin count
+// and the number of worker threads, and with channels jobs per tile, makes
+// sure every worker has one.  If grow is set, tiles whose overlap would be
+// too much for TILE_WORKER_BYTES grow up to the workers' share of
+// TILE_MEMORY_BYTES instead.  Otherwise histograms are tile_size pixels
+// square.  Returns false if no tile can hold a window.
+bool get_tile_geometry(uint32_t width, uint32_t height, uint32_t channels,
+                       uint32_t radius, uint32_t num_bins, uint32_t tile_size,
+                       uint32_t num_threads, bool grow,
+                       uint32_t &tile_width, uint32_t &tile_height);
+
+// Filter source into dest, using num_bins histogram bins, which must pass
+// filter_bins_supported.
+//
+// dest may cover just part of source, with its top left corner at
+// (x_origin, y_origin), in which case the rest of source is only used as the
+// surroundings of dest's pixels.  If reader is given, source starts out empty
+// and is read in bands as the filter runs.  cached and progress may be NULL.
+// Guided filtering always uses the sliding engine.
+//
+// Returns false if num_bins is not supported, leaving dest alone, or if the
+// filter was cancelled, leaving dest incomplete.
+bool filter_image_with_bins(uint32_t num_bins,
+                            spectral::Image *source,
+                            const source_reader *reader,
+                            uint32_t x_origin,
+                            uint32_t y_origin,
+                            uint32_t radius,
+                            uint32_t threshold,
+                            bool use_linear,
+                            uint32_t tile_size,
+                            uint32_t num_threads,
+                            filter_engine engine,
+                            filter_guide guide,
+                            filter_alpha alpha,
+                            const cached_source *cached,
+                            filter_progress_fun progress,
+                            void *progress_data,
+                            spectral::Image *dest);
+
+// Bring out detail, by pushing each sample of source away from its filtered
+// value by contrast times their difference.  The result is scaled down so
+// that the largest value fits, and left in dest.  The largest value is found
+// as each tile is filtered, so only one more pass over dest is needed.
+// Arguments are otherwise as for filter_image_with_bins.
+bool enhance_image_with_bins(uint32_t num_bins,
+                             spectral::Image *source,
+                             const source_reader *reader,
+                             uint32_t x_origin,
+                             uint32_t y_origin,
+                             uint32_t radius,
+                             uint32_t threshold,
+                             bool use_linear,
+                             uint32_t tile_size,
+                             uint32_t num_threads,
+                             filter_engine engine,
+                             filter_guide guide,
+                             filter_alpha alpha,
+                             const cached_source *cached,
+                             float contrast,
+                             filter_progress_fun progress,
+                             void *progress_data,
+                             spectral::Image *dest);
+#endif
+#endif
@@ -0,0 +1,204 @@
+#include "histogram_cache.h"
+
+namespace spectral
+{
+
+static bool same_key(const HistogramCache::Key &a, const HistogramCache::Key &b)
+{
+    return (a.id == b.id) && (a.x == b.x) && (a.y == b.y) &&
+           (a.width == b.width) && (a.height == b.height) &&
+           (a.channel == b.channel) && (a.bins == b.bins) &&
+           (a.count_size == b.count_size) && (a.layout == b.layout);
+}
+
+HistogramCache::HistogramCache(size_t budget)
+    : m_entries(NULL)
+    , m_budget(budget)
+    , m_used(0)
+    , m_clock(0)
+    , m_pass_start(0)
+{
+    pthread_mutex_init(&m_mutex, NULL);
+}
+
+HistogramCache::~HistogramCache()
+{
+    while(m_entries)
+    {
+        Remove(m_entries);
+    }
+    pthread_mutex_destroy(&m_mutex);
+}
+
+const void *HistogramCache::Acquire(const Key &key, uint64_t checksum)
+{
+    const void *result(NULL);
+    Entry *entry;
+
+    pthread_mutex_lock(&m_mutex);
+    for(entry = m_entries; entry; entry = entry->next)
+    {
+        if(!entry->dead && same_key(entry->key, key))
+        {
+            break;
+        }
+    }
+    if(entry)
+    {
+        if(entry->checksum == checksum)
+        {
+            entry->users++;
+            entry->last_used = ++m_clock;
+            result = entry->hist;
+        }
+        else
+        {
+            // The pixels have changed, so it will never match again.
+            Retire(entry);
+        }
+    }
+    pthread_mutex_unlock(&m_mutex);
+
+    return result;
+}
+
+void HistogramCache::Release(const void *hist)
+{
+    pthread_mutex_lock(&m_mutex);
+    for(Entry *entry = m_entries; entry; entry = entry->next)
+    {
+        if(entry->hist == hist)
+        {
+            entry->users--;
+            if(!entry->users && entry->dead)
+            {
+                Remove(entry);
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&m_mutex);
+}
+
+bool HistogramCache::Insert(const Key &key, uint64_t checksum, void *hist,
+                            size_t bytes, destroy_fun destroy)
+{
+    bool result(false);
+
+    pthread_mutex_lock(&m_mutex);
+
+    // Replace any stale entry for the same region.
+    for(Entry *entry = m_entries; entry; entry = entry->next)
+    {
+        if(!entry->dead && same_key(entry->key, key))
+        {
+            Retire(entry);
+            break;
+        }
+    }
+
+    if(MakeRoom(bytes))
+    {
+        Entry *entry = new Entry;
+
+        entry->key = key;
+        entry->checksum = checksum;
+        entry->hist = hist;
+        entry->bytes = bytes;
+        entry->destroy = destroy;
+        entry->users = 0;
+        entry->dead = false;
+        entry->last_used = ++m_clock;
+        entry->next = m_entries;
+
+        m_entries = entry;
+        m_used+= bytes;
+        result = true;
+    }
+    pthread_mutex_unlock(&m_mutex);
+
+    return result;
+}
+
+void HistogramCache::StartPass(void)
+{
+    pthread_mutex_lock(&m_mutex);
+    m_pass_start = ++m_clock;
+    pthread_mutex_unlock(&m_mutex);
+}
+
+void HistogramCache::Clear(void)
+{
+    pthread_mutex_lock(&m_mutex);
+    {
+        Entry *entry(m_entries);
+
+        while(entry)
+        {
+            Entry *next(entry->next);
+
+            if(!entry->users)
+            {
+                Remove(entry);
+            }
+            entry = next;
+        }
+    }
+    pthread_mutex_unlock(&m_mutex);
+}
+
+bool HistogramCache::MakeRoom(size_t bytes)
+{
+    if(bytes > m_budget)
+    {
+        return false;
+    }
+    while((m_used + bytes) > m_budget)
+    {
+        Entry *oldest(NULL);
+
+        for(Entry *entry = m_entries; entry; entry = entry->next)
+        {
+            if(!entry->users && (entry->last_used < m_pass_start) &&
+                    (!oldest || (entry->last_used < oldest->last_used)))
+            {
+                oldest = entry;
+            }
+        }
+        if(!oldest)
+        {
+            return false;
+        }
+        Remove(oldest);
+    }
+    return true;
+}
+
+void HistogramCache::Retire(Entry *entry)
+{
+    if(entry->users)
+    {
+        entry->dead = true;
+    }
+    else
+    {
+        Remove(entry);
+    }
+}
+
+void HistogramCache::Remove(Entry *entry)
+{
+    Entry **link(&m_entries);
+
+    while(*link != entry)
+    {
+        link = &((*link)->next);
+    }
+    *link = entry->next;
+
+    m_used-= entry->bytes;
+    entry->destroy(entry->hist);
+    delete entry;
+}
+
+}
@@ -0,0 +1,90 @@
+#ifndef __HISTOGRAM_CACHE_H__
+#define __HISTOGRAM_CACHE_H__
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+namespace spectral
+{
+
+// Cache of integral histograms, so that filtering the same pixels again with
+// a different threshold or weighting can skip building them.  Each entry is
+// keyed by where its region lies in the source, and carries a checksum of the
+// pixels it was built from, so edited pixels are never matched.  Entries are
+// dropped, least recently used first, to keep within a memory budget.
+//
+// Histograms are stored untyped; the key records their bin count, count size
+// and layout, so that only the code that made an entry will ever get it back.
+class HistogramCache
+{
+public:
+    typedef struct _Key
+    {
+        int32_t id;                 // which image the pixels came from
+        int32_t x, y;               // top left of the region in that image
+        uint32_t width, height, channel;
+        uint32_t bins, count_size;
+        uint32_t layout;            // bins per plane, or 0 for pixel major
+    } Key;
+
+    typedef void (*destroy_fun)(void *hist);
+
+    HistogramCache(size_t budget);
+    ~HistogramCache();
+
+    // Find the histogram for a region, if its pixels still match checksum.
+    // A histogram that is found stays in the cache at least until it is
+    // released.
+    const void *Acquire(const Key &key, uint64_t checksum);
+    void Release(const void *hist);
+
+    // Hand a histogram over to the cache.  Returns false, leaving the caller
+    // owning it, if there is no room for it.
+    bool Insert(const Key &key, uint64_t checksum, void *hist, size_t bytes,
+                destroy_fun destroy);
+
+    // Mark the start of a pass over an image.  Entries used since then are
+    // not dropped to make room for others, so a pass that needs more than the
+    // budget keeps what it has cached rather than cycling through it all and
+    // finding nothing next time.
+    void StartPass(void);
+
+    // Drop every entry that is not in use.
+    void Clear(void);
+
+    size_t get_budget(void) const
+    {
+        return m_budget;
+    }
+
+private:
+    typedef struct _Entry
+    {
+        Key key;
+        uint64_t checksum;
+        void *hist;
+        size_t bytes;
+        destroy_fun destroy;
+        uint32_t users;
+        bool dead;                  // replaced, so freed on last release
+        uint64_t last_used;
+        struct _Entry *next;
+    } Entry;
+
+    // Remove unused entries from before this pass, oldest first, until bytes
+    // more will fit.
+    bool MakeRoom(size_t bytes);
+    // Drop an entry that will never match again, or if it is still in use,
+    // hide it from lookups and leave it for its last Release to drop.
+    void Retire(Entry *entry);
+    void Remove(Entry *entry);
+
+    Entry *m_entries;
+    size_t m_budget, m_used;
+    uint64_t m_clock, m_pass_start;
+    pthread_mutex_t m_mutex;
+};
+
+}
+
+#endif
@@ -1,9 +1,221 @@
 #include <math.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include "image.h"
+#include "simd.h"
+
+#include "settings.h"
 
 namespace spectral
 {
 
+////////////////////////////////////////////////////////////////////////////////
+// Buffers come from new[] like everything else, over-allocated so that they
+// can be aligned, with the block they came from stored just in front and a
+// spare word in front of that for allocators built on this one to use.
+class aligned_allocator : public image_allocator
+{
+public:
+    void *allocate(size_t bytes)
+    {
+        return allocate_aligned(bytes, IMAGE_ALIGNMENT);
+    }
+
+    void release(void *buffer, size_t)
+    {
+        delete [] ((char **)buffer)[-1];
+    }
+
+protected:
+    static void *allocate_aligned(size_t bytes, size_t alignment)
+    {
+        char *block = new char[bytes + alignment + (sizeof(char *) * 2)];
+        uintptr_t start((uintptr_t)(block + (sizeof(char *) * 2)));
+        char **result((char **)((start + alignment - 1) & ~uintptr_t(alignment - 1)));
+
+        result[-1] = block;
+        result[-2] = NULL;
+        return result;
+    }
+
+    static void *&get_spare(void *buffer)
+    {
+        return ((void **)buffer)[-2];
+    }
+};
+
+// The advice is only a hint, so failing to take it costs nothing but speed.
+class huge_page_allocator : public aligned_allocator
+{
+public:
+    void *allocate(size_t bytes)
+    {
+#if defined(MADV_HUGEPAGE)
+        if((HUGE_PAGE_BYTES > 0) && (bytes >= HUGE_PAGE_BYTES))
+        {
+            void *result = allocate_aligned(bytes, HUGE_PAGE_BYTES);
+
+            madvise(result, bytes & ~size_t(HUGE_PAGE_BYTES - 1), MADV_HUGEPAGE);
+            return result;
+        }
+#endif
+        return aligned_allocator::allocate(bytes);
+    }
+};
+
+// Workers already rebuild one histogram in place for all their tiles, but
+// each histogram handed over to the cache used to start again with fresh
+// memory that the kernel had to fault in and zero.  The arena keeps released
+// buffers, up to HISTOGRAM_ARENA_BYTES of them, for the next histogram that
+// fits, until Drain hands them back.  Buffers more than twice the size needed
+// are left for bigger histograms.  Each buffer's block is kept in its spare
+// word, so releasing one needs no search.
+class histogram_arena : public huge_page_allocator
+{
+public:
+    histogram_arena()
+        : m_free(NULL)
+        , m_free_bytes(0)
+    {
+        pthread_mutex_init(&m_mutex, NULL);
+    }
+
+    void *allocate(size_t bytes)
+    {
+        block **best(NULL), *b;
+
+        pthread_mutex_lock(&m_mutex);
+        for(block **link=&m_free; *link; link=&((*link)->next))
+        {
+            if(((*link)->bytes >= bytes) && ((*link)->bytes <= (bytes * 2)) &&
+                    (!best || ((*link)->bytes < (*best)->bytes)))
+            {
+                best = link;
+            }
+        }
+        if(best)
+        {
+            b = *best;
+            *best = b->next;
+            m_free_bytes-= b->bytes;
+        }
+        pthread_mutex_unlock(&m_mutex);
+
+        if(!best)
+        {
+            b = new block;
+            b->bytes = bytes;
+            b->buffer = huge_page_allocator::allocate(bytes);
+            get_spare(b->buffer) = b;
+        }
+        return b->buffer;
+    }
+
+    void release(void *buffer, size_t)
+    {
+        block *b = (block *)get_spare(buffer);
+
+        if(b->bytes > HISTOGRAM_ARENA_BYTES)
+        {
+            free_block(b);
+            return;
+        }
+
+        pthread_mutex_lock(&m_mutex);
+        // Older buffers make way for this one.
+        while(m_free && ((m_free_bytes + b->bytes) > HISTOGRAM_ARENA_BYTES))
+        {
+            block **oldest(&m_free), *old;
+
+            while((*oldest)->next)
+            {
+                oldest = &((*oldest)->next);
+            }
+            old = *oldest;
+            *oldest = NULL;
+            m_free_bytes-= old->bytes;
+            free_block(old);
+        }
+        b->next = m_free;
+        m_free = b;
+        m_free_bytes+= b->bytes;
+        pthread_mutex_unlock(&m_mutex);
+    }
+
+    // Give every kept buffer back to the system.
+    void Drain(void)
+    {
+        block *b;
+
+        pthread_mutex_lock(&m_mutex);
+        b = m_free;
+        m_free = NULL;
+        m_free_bytes = 0;
+        pthread_mutex_unlock(&m_mutex);
+
+        while(b)
+        {
+            block *next(b->next);
+
+            free_block(b);
+            b = next;
+        }
+    }
+
+private:
+    typedef struct _block
+    {
+        void *buffer;
+        size_t bytes;
+        struct _block *next;
+    } block;
+
+    void free_block(block *b)
+    {
+        huge_page_allocator::release(b->buffer, b->bytes);
+        delete b;
+    }
+
+    block *m_free;              // most recently released first
+    size_t m_free_bytes;
+    pthread_mutex_t m_mutex;
+};
+
+// Never destroyed, as histograms may outlive static destructors.
+static histogram_arena *
+get_histogram_arena(void)
+{
+    static histogram_arena *arena = new histogram_arena;
+    return arena;
+}
+
+image_allocator *
+get_default_allocator(void)
+{
+    static aligned_allocator allocator;
+    return &allocator;
+}
+
+image_allocator *
+get_huge_page_allocator(void)
+{
+    static huge_page_allocator allocator;
+    return &allocator;
+}
+
+image_allocator *
+get_histogram_allocator(void)
+{
+    return get_histogram_arena();
+}
+
+void
+drain_histogram_allocator(void)
+{
+    get_histogram_arena()->Drain();
+}
+
 Image::Image(uint32_t width,
              uint32_t height,
              uint32_t channels,
@@ -24,36 +236,6 @@ Image::~Image()
 {
 }
 
-// Expand an image, adding a reflected border.
-Image *
-Image::Expand(uint32_t x_border, uint32_t y_border,
-              bool wrap_x, bool wrap_y) const
-{
-    Image *result(NULL);
-
-    uint32_t new_width  = get_width() + (x_border * 2);
-    uint32_t new_height = get_height()+ (y_border * 2);
-    result = new Image(new_width, new_height, get_channels());
-
-    if(result)
-    {
-        for (int32_t y=0; uint32_t(y)<new_height; y++)
-        {
-            int32_t yy;
-            yy = int32_t(y) - int32_t(y_border);
-            for(int32_t x=0; uint32_t(x)<new_width; x++)
-            {
-                int32_t xx;
-                xx = int32_t(x) - int32_t(x_border);
-                result->set_pixel(x,y,get_constrained_pixel(xx,yy,
-                                  wrap_x,wrap_y));
-            }
-        }
-    }
-
-    return result;
-}
-
 Image *
 Image::Contract(uint32_t x_border, uint32_t y_border) const
 {
@@ -85,116 +267,686 @@ Image::Contract(uint32_t x_border, uint32_t y_border) const
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-IntegralHistogram::IntegralHistogram(uint32_t bins, const Image &img, uint32_t channel)
-    : image<uint32_t>(img.get_width(), img.get_height(), bins)
+// Per-pixel kernels for building integral histograms: out = above + row_sum,
+// over all the bins.  The widest version the cpu supports is picked at
+// startup.
+template <typename T>
+struct add_bins_kernel
+{
+    typedef void (*fun)(T *out, const T *above, const T *row_sum);
+};
+
+template <typename T, uint32_t BINS>
+static void add_bins_scalar(T *out, const T *above, const T *row_sum)
 {
-    BuildHistogram(bins, img, 0, 0, img.get_width(), img.get_height(), channel);
+    for(uint32_t i=0; i<BINS; i++)
+    {
+        out[i] = above[i] + row_sum[i];
+    }
 }
 
-IntegralHistogram::IntegralHistogram(uint32_t bins, const Image &img,
-                                     uint32_t x0, uint32_t y0,
-                                     uint32_t width, uint32_t height,
-                                     uint32_t channel)
-    : image<uint32_t>(width, height, bins)
+#if defined(HAVE_X86_SIMD)
+template <uint32_t BINS>
+__attribute__((target("sse2")))
+static void add_bins_sse2(uint32_t *out, const uint32_t *above,
+                          const uint32_t *row_sum)
+{
+    uint32_t i(0);
+
+    for(; i+4<=BINS; i+=4)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(above + i));
+        __m128i r = _mm_loadu_si128((const __m128i *)(row_sum + i));
+        _mm_storeu_si128((__m128i *)(out + i), _mm_add_epi32(a, r));
+    }
+    for(; i<BINS; i++)
+    {
+        out[i] = above[i] + row_sum[i];
+    }
+}
+
+template <uint32_t BINS>
+__attribute__((target("sse2")))
+static void add_bins_sse2(uint16_t *out, const uint16_t *above,
+                          const uint16_t *row_sum)
+{
+    uint32_t i(0);
+
+    for(; i+8<=BINS; i+=8)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(above + i));
+        __m128i r = _mm_loadu_si128((const __m128i *)(row_sum + i));
+        _mm_storeu_si128((__m128i *)(out + i), _mm_add_epi16(a, r));
+    }
+    for(; i<BINS; i++)
+    {
+        out[i] = above[i] + row_sum[i];
+    }
+}
+
+template <uint32_t BINS>
+__attribute__((target("avx2")))
+static void add_bins_avx2(uint32_t *out, const uint32_t *above,
+                          const uint32_t *row_sum)
+{
+    uint32_t i(0);
+
+    for(; i+8<=BINS; i+=8)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(above + i));
+        __m256i r = _mm256_loadu_si256((const __m256i *)(row_sum + i));
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_add_epi32(a, r));
+    }
+    for(; i<BINS; i++)
+    {
+        out[i] = above[i] + row_sum[i];
+    }
+}
+
+template <uint32_t BINS>
+__attribute__((target("avx2")))
+static void add_bins_avx2(uint16_t *out, const uint16_t *above,
+                          const uint16_t *row_sum)
+{
+    uint32_t i(0);
+
+    for(; i+16<=BINS; i+=16)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(above + i));
+        __m256i r = _mm256_loadu_si256((const __m256i *)(row_sum + i));
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_add_epi16(a, r));
+    }
+    for(; i<BINS; i++)
+    {
+        out[i] = above[i] + row_sum[i];
+    }
+}
+#endif
+
+template <typename T, uint32_t BINS>
+static typename add_bins_kernel<T>::fun select_add_bins(void)
+{
+#if defined(HAVE_X86_SIMD)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+    {
+        return add_bins_avx2<BINS>;
+    }
+    if(__builtin_cpu_supports("sse2"))
+    {
+        return add_bins_sse2<BINS>;
+    }
+#endif
+    return add_bins_scalar<T, BINS>;
+}
+
+template <typename T, uint32_t BINS>
+static typename add_bins_kernel<T>::fun get_add_bins(void)
+{
+    static const typename add_bins_kernel<T>::fun add_bins = select_add_bins<T, BINS>();
+    return add_bins;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Per-row kernels for building one plane of a slab_integral_histogram: the
+// running counts of the slab's 8 bins stay in a register while the row of
+// entries out = above + row_sum is written.  Bins are relative to the start
+// of the slab, so a pixel outside it matches no lane and counts nothing.
+template <typename T>
+struct add_slab_row_kernel
+{
+    typedef void (*fun)(T *out, const T *above, const uint8_t *bins,
+                        uint32_t width, uint32_t slab_bin);
+};
+
+template <typename T>
+static void add_slab_row_scalar(T *out, const T *above, const uint8_t *bins,
+                                uint32_t width, uint32_t slab_bin)
+{
+    T row_sum[8] = { 0 };
+
+    for(uint32_t x=0; x<width; x++)
+    {
+        uint32_t bin(uint32_t(bins[x]) - slab_bin);
+
+        if(bin < 8)
+        {
+            row_sum[bin]++;
+        }
+        for(uint32_t i=0; i<8; i++)
+        {
+            out[i] = above[i] + row_sum[i];
+        }
+        above+= 8;
+        out+= 8;
+    }
+}
+
+#if defined(HAVE_X86_SIMD)
+__attribute__((target("sse2")))
+static void add_slab_row_sse2(uint32_t *out, const uint32_t *above,
+                              const uint8_t *bins, uint32_t width,
+                              uint32_t slab_bin)
+{
+    const __m128i lanes_lo = _mm_setr_epi32(0, 1, 2, 3);
+    const __m128i lanes_hi = _mm_setr_epi32(4, 5, 6, 7);
+    __m128i sum_lo = _mm_setzero_si128(), sum_hi = _mm_setzero_si128();
+
+    for(uint32_t x=0; x<width; x++)
+    {
+        __m128i bin = _mm_set1_epi32(int32_t(bins[x]) - int32_t(slab_bin));
+
+        // Equal lanes are all ones, so subtracting them adds one.
+        sum_lo = _mm_sub_epi32(sum_lo, _mm_cmpeq_epi32(bin, lanes_lo));
+        sum_hi = _mm_sub_epi32(sum_hi, _mm_cmpeq_epi32(bin, lanes_hi));
+        _mm_storeu_si128((__m128i *)out,
+                         _mm_add_epi32(_mm_loadu_si128((const __m128i *)above), sum_lo));
+        _mm_storeu_si128((__m128i *)(out + 4),
+                         _mm_add_epi32(_mm_loadu_si128((const __m128i *)(above + 4)), sum_hi));
+        above+= 8;
+        out+= 8;
+    }
+}
+
+__attribute__((target("sse2")))
+static void add_slab_row_sse2(uint16_t *out, const uint16_t *above,
+                              const uint8_t *bins, uint32_t width,
+                              uint32_t slab_bin)
+{
+    const __m128i lanes = _mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7);
+    __m128i sum = _mm_setzero_si128();
+
+    for(uint32_t x=0; x<width; x++)
+    {
+        __m128i bin = _mm_set1_epi16(int16_t(int32_t(bins[x]) - int32_t(slab_bin)));
+
+        sum = _mm_sub_epi16(sum, _mm_cmpeq_epi16(bin, lanes));
+        _mm_storeu_si128((__m128i *)out,
+                         _mm_add_epi16(_mm_loadu_si128((const __m128i *)above), sum));
+        above+= 8;
+        out+= 8;
+    }
+}
+
+__attribute__((target("avx2")))
+static void add_slab_row_avx2(uint32_t *out, const uint32_t *above,
+                              const uint8_t *bins, uint32_t width,
+                              uint32_t slab_bin)
+{
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i sum = _mm256_setzero_si256();
+
+    for(uint32_t x=0; x<width; x++)
+    {
+        __m256i bin = _mm256_set1_epi32(int32_t(bins[x]) - int32_t(slab_bin));
+
+        sum = _mm256_sub_epi32(sum, _mm256_cmpeq_epi32(bin, lanes));
+        _mm256_storeu_si256((__m256i *)out,
+                            _mm256_add_epi32(_mm256_loadu_si256((const __m256i *)above), sum));
+        above+= 8;
+        out+= 8;
+    }
+}
+
+// A slab of 16 bit counts fills only half an AVX2 register, so SSE2 is as
+// wide as it gets for those.
+__attribute__((target("avx2")))
+static void add_slab_row_avx2(uint16_t *out, const uint16_t *above,
+                              const uint8_t *bins, uint32_t width,
+                              uint32_t slab_bin)
+{
+    add_slab_row_sse2(out, above, bins, width, slab_bin);
+}
+#endif
+
+template <typename T>
+static typename add_slab_row_kernel<T>::fun select_add_slab_row(void)
+{
+#if defined(HAVE_X86_SIMD)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+    {
+        return add_slab_row_avx2;
+    }
+    if(__builtin_cpu_supports("sse2"))
+    {
+        return add_slab_row_sse2;
+    }
+#endif
+    return add_slab_row_scalar<T>;
+}
+
+template <typename T>
+static typename add_slab_row_kernel<T>::fun get_add_slab_row(void)
+{
+    static const typename add_slab_row_kernel<T>::fun add_slab_row = select_add_slab_row<T>();
+    return add_slab_row;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Per-window kernels for querying integral histograms: the counts for a
+// window from its four corner entries, result = c - b - d + a, widened to 32
+// bits.  Sums are done in T so that wrapped prefix sums still give the right
+// count.  As for add_bins, the widest version the cpu supports is picked.
+template <typename T>
+struct combine_kernel
+{
+    typedef void (*fun)(const T *a, const T *b, const T *c, const T *d,
+                        uint32_t *result);
+};
+
+template <typename T, uint32_t BINS>
+static void combine_scalar(const T *a, const T *b, const T *c, const T *d,
+                           uint32_t *result)
+{
+    for(uint32_t i=0; i<BINS; i++)
+    {
+        T count = c[i] - b[i] - d[i] + a[i];
+        result[i] = count;
+    }
+}
+
+#if defined(HAVE_X86_SIMD)
+template <uint32_t BINS>
+__attribute__((target("sse2")))
+static void combine_sse2(const uint32_t *a, const uint32_t *b,
+                         const uint32_t *c, const uint32_t *d,
+                         uint32_t *result)
+{
+    for(uint32_t i=0; i<BINS; i+=4)
+    {
+        __m128i count = _mm_sub_epi32(_mm_loadu_si128((const __m128i *)(c + i)),
+                                      _mm_loadu_si128((const __m128i *)(b + i)));
+        count = _mm_sub_epi32(count, _mm_loadu_si128((const __m128i *)(d + i)));
+        count = _mm_add_epi32(count, _mm_loadu_si128((const __m128i *)(a + i)));
+        _mm_storeu_si128((__m128i *)(result + i), count);
+    }
+}
+
+template <uint32_t BINS>
+__attribute__((target("sse2")))
+static void combine_sse2(const uint16_t *a, const uint16_t *b,
+                         const uint16_t *c, const uint16_t *d,
+                         uint32_t *result)
+{
+    const __m128i zero = _mm_setzero_si128();
+
+    for(uint32_t i=0; i<BINS; i+=8)
+    {
+        __m128i count = _mm_sub_epi16(_mm_loadu_si128((const __m128i *)(c + i)),
+                                      _mm_loadu_si128((const __m128i *)(b + i)));
+        count = _mm_sub_epi16(count, _mm_loadu_si128((const __m128i *)(d + i)));
+        count = _mm_add_epi16(count, _mm_loadu_si128((const __m128i *)(a + i)));
+        _mm_storeu_si128((__m128i *)(result + i), _mm_unpacklo_epi16(count, zero));
+        _mm_storeu_si128((__m128i *)(result + i + 4), _mm_unpackhi_epi16(count, zero));
+    }
+}
+
+template <uint32_t BINS>
+__attribute__((target("avx2")))
+static void combine_avx2(const uint32_t *a, const uint32_t *b,
+                         const uint32_t *c, const uint32_t *d,
+                         uint32_t *result)
+{
+    for(uint32_t i=0; i<BINS; i+=8)
+    {
+        __m256i count = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i *)(c + i)),
+                                         _mm256_loadu_si256((const __m256i *)(b + i)));
+        count = _mm256_sub_epi32(count, _mm256_loadu_si256((const __m256i *)(d + i)));
+        count = _mm256_add_epi32(count, _mm256_loadu_si256((const __m256i *)(a + i)));
+        _mm256_storeu_si256((__m256i *)(result + i), count);
+    }
+}
+
+template <uint32_t BINS>
+__attribute__((target("avx2")))
+static void combine_avx2(const uint16_t *a, const uint16_t *b,
+                         const uint16_t *c, const uint16_t *d,
+                         uint32_t *result)
+{
+    uint32_t i(0);
+
+    for(; i+16<=BINS; i+=16)
+    {
+        __m256i count = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i *)(c + i)),
+                                         _mm256_loadu_si256((const __m256i *)(b + i)));
+        count = _mm256_sub_epi16(count, _mm256_loadu_si256((const __m256i *)(d + i)));
+        count = _mm256_add_epi16(count, _mm256_loadu_si256((const __m256i *)(a + i)));
+        _mm256_storeu_si256((__m256i *)(result + i),
+                            _mm256_cvtepu16_epi32(_mm256_castsi256_si128(count)));
+        _mm256_storeu_si256((__m256i *)(result + i + 8),
+                            _mm256_cvtepu16_epi32(_mm256_extracti128_si256(count, 1)));
+    }
+    for(; i<BINS; i+=8)
+    {
+        __m128i count = _mm_sub_epi16(_mm_loadu_si128((const __m128i *)(c + i)),
+                                      _mm_loadu_si128((const __m128i *)(b + i)));
+        count = _mm_sub_epi16(count, _mm_loadu_si128((const __m128i *)(d + i)));
+        count = _mm_add_epi16(count, _mm_loadu_si128((const __m128i *)(a + i)));
+        _mm256_storeu_si256((__m256i *)(result + i), _mm256_cvtepu16_epi32(count));
+    }
+}
+#endif
+
+template <typename T, uint32_t BINS>
+static typename combine_kernel<T>::fun select_combine(void)
+{
+#if defined(HAVE_X86_SIMD)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+    {
+        return combine_avx2<BINS>;
+    }
+    if(__builtin_cpu_supports("sse2"))
+    {
+        return combine_sse2<BINS>;
+    }
+#endif
+    return combine_scalar<T, BINS>;
+}
+
+template <typename T, uint32_t BINS>
+static typename combine_kernel<T>::fun get_combine(void)
+{
+    static const typename combine_kernel<T>::fun combine = select_combine<T, BINS>();
+    return combine;
+}
+
+// The combine kernel for a span of bins chosen at runtime.
+template <typename T>
+static typename combine_kernel<T>::fun get_span_combine(uint32_t span)
+{
+    switch(span)
+    {
+    case 8:
+        return get_combine<T, 8>();
+    case 16:
+        return get_combine<T, 16>();
+    case 32:
+        return get_combine<T, 32>();
+    case 64:
+        return get_combine<T, 64>();
+    case 128:
+        return get_combine<T, 128>();
+    default:
+        return get_combine<T, 256>();
+    }
+}
+
+// The add_bins kernel for a span of bins chosen at runtime.
+template <typename T>
+static typename add_bins_kernel<T>::fun get_span_add_bins(uint32_t span)
+{
+    switch(span)
+    {
+    case 8:
+        return get_add_bins<T, 8>();
+    case 16:
+        return get_add_bins<T, 16>();
+    case 32:
+        return get_add_bins<T, 32>();
+    case 64:
+        return get_add_bins<T, 64>();
+    case 128:
+        return get_add_bins<T, 128>();
+    default:
+        return get_add_bins<T, 256>();
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+template <typename T, uint32_t BINS>
+integral_histogram<T, BINS>::integral_histogram(const ImageView &img,
+        uint32_t channel)
+    : image<T>(img.get_width() + 1, img.get_height() + 1, BINS,
+               image_flags(IMAGE_NO_INIT | IMAGE_PAD_ROWS),
+               get_histogram_allocator())
+    , m_first_bin(0)
+    , m_combine(get_combine<T, BINS>())
+{
+    BuildHistogram(img, 0, 0, img.get_width(), img.get_height(), channel);
+}
+
+template <typename T, uint32_t BINS>
+integral_histogram<T, BINS>::integral_histogram(const ImageView &img,
+        int32_t x0, int32_t y0,
+        uint32_t width, uint32_t height,
+        uint32_t channel)
+    : image<T>(width + 1, height + 1, BINS,
+               image_flags(IMAGE_NO_INIT | IMAGE_PAD_ROWS),
+               get_histogram_allocator())
+    , m_first_bin(0)
+    , m_combine(get_combine<T, BINS>())
+{
+    BuildHistogram(img, x0, y0, width, height, channel);
+}
+
+template <typename T, uint32_t BINS>
+integral_histogram<T, BINS>::integral_histogram(uint32_t width, uint32_t height)
+    : image<T>(width + 1, height + 1, BINS,
+               image_flags(IMAGE_NO_INIT | IMAGE_PAD_ROWS),
+               get_histogram_allocator())
+    , m_first_bin(0)
+    , m_combine(get_combine<T, BINS>())
+{
+}
+
+template <typename T, uint32_t BINS>
+integral_histogram<T, BINS>::~integral_histogram()
 {
-    BuildHistogram(bins, img, x0, y0, width, height, channel);
 }
 
-IntegralHistogram::~IntegralHistogram()
+template <typename T, uint32_t BINS>
+void
+integral_histogram<T, BINS>::Rebuild(const ImageView &img, int32_t x0, int32_t y0,
+                                     uint32_t width, uint32_t height,
+                                     uint32_t channel,
+                                     uint32_t first_bin, uint32_t span)
 {
+    this->reshape(width + 1, height + 1, span);
+    m_first_bin = first_bin;
+    m_combine = (span == BINS) ? get_combine<T, BINS>()
+                               : get_span_combine<T>(span);
+    BuildHistogram(img, x0, y0, width, height, channel);
 }
 
+// Each entry is the entry above plus the running sum of this row so far,
+// so a pixel costs one increment and one vector add across the bins.  Rows
+// are fetched through get_constrained_row, so the parts of the region
+// outside img come from a reflected border that is never stored.  Only the
+// bins in the span are counted.  The leading row and column of zeros mean
+// every entry has one above it.
+template <typename T, uint32_t BINS>
 void
-IntegralHistogram::BuildHistogram(uint32_t bins, const Image &img,
-                                  uint32_t x0, uint32_t y0,
-                                  uint32_t width, uint32_t height,
-                                  uint32_t channel)
+integral_histogram<T, BINS>::BuildHistogram(const ImageView &img,
+        int32_t x0, int32_t y0,
+        uint32_t width, uint32_t height,
+        uint32_t channel)
 {
     uint32_t x,y;
-    uint32_t index(0), in_index(0);
-    uint32_t shift(0);
+    uint32_t span(get_span());
+    uint32_t first_value(m_first_bin * (256 / BINS));
+    size_t stride(this->get_stride());
+    T row_sum[BINS], *out;
+    const T *above;
+    uint8_t *pixels;
+    typename add_bins_kernel<T>::fun add_bins;
+
+    add_bins = (span == BINS) ? get_add_bins<T, BINS>()
+                              : get_span_add_bins<T>(span);
+
+    memset(this->get_buffer(), 0, (width + 1) * span * sizeof(T));
+    pixels = new uint8_t[width];
 
+    for(y=0; y<height; y++)
     {
-        uint32_t tmp(256);
+        const uint8_t *in(pixels);
 
-        while(tmp > bins)
+        img.get_constrained_row(x0, y0 + int32_t(y), width, channel, pixels);
+
+        out = this->get_buffer() + ((y + 1) * stride);
+        memset(row_sum, 0, span * sizeof(T));
+        memset(out, 0, span * sizeof(T));
+        out+= span;
+        above = out - stride;
+
+        for(x=0; x<width; x++)
         {
-            tmp>>=1;
-            shift++;
+            row_sum[((*in) - first_value) / (256 / BINS)]++;
+            in++;
+
+            add_bins(out, above, row_sum);
+            above+= span;
+            out+= span;
         }
     }
 
-    for(y=0; y<get_height(); y++)
+    delete [] pixels;
+}
+
+// Coordinates are of pixels in the region, so the window's corners are the
+// entries just above and left of (x1, y1), and at (x2 + 1, y2 + 1).
+template <typename T, uint32_t BINS>
+void
+integral_histogram<T, BINS>::GetHistogram(uint32_t x1, uint32_t y1,
+        uint32_t x2, uint32_t y2,
+        uint32_t *result) const
+{
+    uint32_t i, span(get_span());
+    uint32_t width(this->get_width() - 1), height(this->get_height() - 1);
+
+    if(x1 > x2)
+    {
+        uint32_t tmp = x1;
+        x1 = x2;
+        x2 = tmp;
+    }
+    if(y1 > y2)
+    {
+        uint32_t tmp = y1;
+        y1 = y2;
+        y2 = tmp;
+    }
+
+    for(i=0; i<m_first_bin; i++)
+    {
+        result[i] = 0;
+    }
+    for(i=m_first_bin + span; i<BINS; i++)
     {
+        result[i] = 0;
+    }
+    result+= m_first_bin;
+
+    if((x1 < width) && (y1 < height))
+    {
+        if(x2 >= width)
         {
-            uint32_t yy = y0 + y;
-            in_index = (((yy * img.get_width()) + x0) * img.get_channels()) + channel;
+            x2 = width - 1;
+        }
+        if(y2 >= height)
+        {
+            y2 = height - 1;
         }
 
-        for(x=0; x<get_width(); x++)
+        m_combine(this->get_pixel(x1, y1), this->get_pixel(x2 + 1, y1),
+                  this->get_pixel(x2 + 1, y2 + 1), this->get_pixel(x1, y2 + 1),
+                  result);
+    }
+    else
+    {
+        for(i=0; i<span; i++)
         {
-            uint32_t bin;
+            result[i] = 0;
+        }
+    }
+}
 
-            // Add 1 to this bin if we are in range.
-            if((x < width) && (y < height))
-            {
-                bin = (img.get_buffer()[in_index]) >> shift;
+////////////////////////////////////////////////////////////////////////////////
+template <typename T, uint32_t BINS>
+slab_integral_histogram<T, BINS>::slab_integral_histogram(uint32_t width,
+        uint32_t height)
+    : image<T>(width + 1, (height + 1) * (BINS / SLAB), SLAB,
+               image_flags(IMAGE_NO_INIT | IMAGE_PAD_ROWS),
+               get_histogram_allocator())
+    , m_first_bin(0)
+    , m_span(BINS)
+    , m_plane_size(this->get_stride() * (height + 1))
+    , m_combine(get_combine<T, SLAB>())
+{
+}
 
-                if(bin < bins)
-                {
-                    get_buffer()[index + bin] = 1;
-                }
-            }
+template <typename T, uint32_t BINS>
+slab_integral_histogram<T, BINS>::~slab_integral_histogram()
+{
+}
 
-            in_index+= img.get_channels();
+template <typename T, uint32_t BINS>
+void
+slab_integral_histogram<T, BINS>::Rebuild(const ImageView &img,
+        int32_t x0, int32_t y0,
+        uint32_t width, uint32_t height,
+        uint32_t channel,
+        uint32_t first_bin, uint32_t span)
+{
+    this->reshape(width + 1, (height + 1) * (span / SLAB), SLAB);
+    m_first_bin = first_bin;
+    m_span = span;
+    m_plane_size = this->get_stride() * (height + 1);
+    BuildHistogram(img, x0, y0, width, height, channel);
+}
 
-            if(x)
-            {
-                // Add previous pixel in x
-                const uint32_t *pixel;
-                uint32_t i;
-                pixel = get_pixel(x-1, y);
-                for(i=0; i<bins; i++)
-                {
-                    get_buffer()[index + i]+= pixel[i];
-                }
-            }
-            if(y)
-            {
-                // Add previous pixel in y
-                const uint32_t *pixel;
-                uint32_t i;
+// Each row of pixels is binned once, and then each plane gets its row of
+// entries in turn, as integral_histogram builds them but counting only the
+// bins of its slab.
+template <typename T, uint32_t BINS>
+void
+slab_integral_histogram<T, BINS>::BuildHistogram(const ImageView &img,
+        int32_t x0, int32_t y0,
+        uint32_t width, uint32_t height,
+        uint32_t channel)
+{
+    uint32_t first_value(m_first_bin * (256 / BINS)), slabs(m_span / SLAB);
+    size_t stride(this->get_stride());
+    typename add_slab_row_kernel<T>::fun add_slab_row = get_add_slab_row<T>();
+    uint8_t *pixels;
 
-                pixel = get_pixel(x, y-1);
-                for(i=0; i<bins; i++)
-                {
-                    get_buffer()[index + i]+= pixel[i];
-                }
-            }
-            if(x && y)
-            {
-                // subtract previous pixel in x,y
-                const uint32_t *pixel;
-                uint32_t i;
+    pixels = new uint8_t[width];
 
-                pixel = get_pixel(x-1, y-1);
-                for(i=0; i<bins; i++)
-                {
-                    get_buffer()[index + i]-= pixel[i];
-                }
-            }
+    for(uint32_t s=0; s<slabs; s++)
+    {
+        memset(this->get_buffer() + (s * m_plane_size), 0,
+               (width + 1) * SLAB * sizeof(T));
+    }
 
-            index+= bins;
+    for(uint32_t y=0; y<height; y++)
+    {
+        img.get_constrained_row(x0, y0 + int32_t(y), width, channel, pixels);
+        for(uint32_t x=0; x<width; x++)
+        {
+            pixels[x] = (pixels[x] - first_value) / (256 / BINS);
+        }
+
+        for(uint32_t s=0; s<slabs; s++)
+        {
+            T *out = this->get_buffer() + (s * m_plane_size) + ((y + 1) * stride);
+
+            memset(out, 0, SLAB * sizeof(T));
+            add_slab_row(out + SLAB, out + SLAB - stride, pixels, width, s * SLAB);
         }
     }
+
+    delete [] pixels;
 }
 
+template <typename T, uint32_t BINS>
 void
-IntegralHistogram::GetHistogram(uint32_t x1, uint32_t y1,
-                                uint32_t x2, uint32_t y2,
-                                uint32_t *result) const
+slab_integral_histogram<T, BINS>::GetHistogram(uint32_t x1, uint32_t y1,
+        uint32_t x2, uint32_t y2,
+        uint32_t *result) const
 {
-    uint32_t i;
+    uint32_t width(this->get_width() - 1);
+    uint32_t height((this->get_height() / (m_span / SLAB)) - 1);
 
     if(x1 > x2)
     {
@@ -209,58 +961,465 @@ IntegralHistogram::GetHistogram(uint32_t x1, uint32_t y1,
         y2 = tmp;
     }
 
-    for(i=0; i<get_channels(); i++)
+    for(uint32_t i=0; i<BINS; i++)
     {
         result[i] = 0;
     }
 
-    if((x1 < get_width()) && (y1 < get_height()))
+    if((x1 < width) && (y1 < height))
     {
-        const uint32_t *a, *b, *c, *d;
-        //
-        //  a-----b
-        //  |     |
-        //  d-----c
-        //
-        // We want to get inclusive points, so we move the top left up,
-        // potentially making a, b, c invalid in the process.
+        const T *top, *bottom;
 
-        a = b = c = d = NULL;
+        if(x2 >= width)
+        {
+            x2 = width - 1;
+        }
+        if(y2 >= height)
+        {
+            y2 = height - 1;
+        }
 
-        if(x2 >= get_width())
+        // The window is x2 - x1 + 1 wide, but need not be square.
+        top = this->get_pixel(x1, y1);
+        bottom = this->get_pixel(x1, y2 + 1);
+        for(uint32_t s=0; s<(m_span / SLAB); s++)
         {
-            x2 = get_width() - 1;
+            size_t plane(s * m_plane_size), right((x2 + 1 - x1) * SLAB);
+
+            m_combine(top + plane, top + plane + right,
+                      bottom + plane + right, bottom + plane,
+                      result + m_first_bin + (s * SLAB));
         }
-        if(y2 >= get_height())
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+template <typename T, uint32_t BINS>
+rolling_integral_histogram<T, BINS>::rolling_integral_histogram(
+    uint32_t max_width,
+    uint32_t max_window)
+    : m_rows(NULL)
+    , m_pixels(NULL)
+    , m_max_width(max_width)
+    , m_max_window(max_window)
+    , m_x0(0), m_y0(0), m_width(0), m_window(0), m_channel(0)
+    , m_top(0)
+{
+    m_rows = new T[ring_size(max_width, max_window) / sizeof(T)];
+    m_pixels = new uint8_t[max_width];
+    stats_track_memory(STATS_MEMORY_HISTOGRAM, ring_size(max_width, max_window));
+}
+
+template <typename T, uint32_t BINS>
+rolling_integral_histogram<T, BINS>::~rolling_integral_histogram()
+{
+    if(m_rows)
+    {
+        stats_track_memory(STATS_MEMORY_HISTOGRAM,
+                           -ptrdiff_t(ring_size(m_max_width, m_max_window)));
+        delete [] m_rows;
+    }
+    if(m_pixels)
+    {
+        delete [] m_pixels;
+    }
+}
+
+template <typename T, uint32_t BINS>
+void
+rolling_integral_histogram<T, BINS>::Reset(const ImageView &img, int32_t x0, int32_t y0,
+                                     uint32_t width, uint32_t window,
+                                     uint32_t channel)
+{
+    if(width > m_max_width)
+    {
+        width = m_max_width;
+    }
+    if(window > m_max_window)
+    {
+        window = m_max_window;
+    }
+
+    m_img = img;
+    m_x0 = x0;
+    m_y0 = y0;
+    m_width = width;
+    m_window = window;
+    m_channel = channel;
+    m_top = 0;
+
+    memset(get_row(0), 0, width * BINS * sizeof(T));
+
+    for(uint32_t k=1; k<=window; k++)
+    {
+        BuildRow(k);
+    }
+}
+
+template <typename T, uint32_t BINS>
+void
+rolling_integral_histogram<T, BINS>::NextRow(void)
+{
+    // The new bottom row replaces the old top row in the ring.
+    BuildRow(m_top + m_window + 1);
+    m_top++;
+}
+
+template <typename T, uint32_t BINS>
+void
+rolling_integral_histogram<T, BINS>::BuildRow(uint32_t k)
+{
+    typename add_bins_kernel<T>::fun add_bins = get_add_bins<T, BINS>();
+    const uint8_t *in;
+    const T *above;
+    T *out;
+
+    m_img.get_constrained_row(m_x0, m_y0 + int32_t(k) - 1, m_width, m_channel,
+                               m_pixels);
+    in = m_pixels;
+    above = get_row(k - 1);
+    out = get_row(k);
+
+    memset(m_row_sum, 0, sizeof(m_row_sum));
+
+    for(uint32_t x=0; x<m_width; x++)
+    {
+        m_row_sum[(*in) / (256 / BINS)]++;
+        in++;
+
+        add_bins(out, above, m_row_sum);
+        out+= BINS;
+        above+= BINS;
+    }
+}
+
+template <typename T, uint32_t BINS>
+void
+rolling_integral_histogram<T, BINS>::GetHistogram(uint32_t x1, uint32_t x2,
+                                            uint32_t *result) const
+{
+    const T *top, *bottom;
+
+    if(x2 >= m_width)
+    {
+        x2 = m_width - 1;
+    }
+
+    top = get_row(m_top);
+    bottom = get_row(m_top + m_window);
+
+    if(x1)
+    {
+        const T *top_left(top + ((x1 - 1) * BINS));
+        const T *bottom_left(bottom + ((x1 - 1) * BINS));
+
+        top+= x2 * BINS;
+        bottom+= x2 * BINS;
+
+        for(uint32_t i=0; i<BINS; i++)
+        {
+            T count = bottom[i] - top[i] - bottom_left[i] + top_left[i];
+            result[i] = count;
+        }
+    }
+    else
+    {
+        top+= x2 * BINS;
+        bottom+= x2 * BINS;
+
+        for(uint32_t i=0; i<BINS; i++)
         {
-            y2 = get_height() - 1;
+            T count = bottom[i] - top[i];
+            result[i] = count;
         }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+template <uint32_t BINS>
+sliding_histogram<BINS>::sliding_histogram(uint32_t max_width)
+    : m_columns(NULL)
+    , m_pixels(NULL)
+    , m_max_width(max_width)
+    , m_x0(0), m_y(0), m_width(0), m_window(0), m_channel(0)
+    , m_x(0)
+{
+    m_columns = new uint16_t[max_width * BINS];
+    m_pixels = new uint8_t[max_width];
+    stats_track_memory(STATS_MEMORY_HISTOGRAM, max_width * BINS * sizeof(uint16_t));
+}
+
+template <uint32_t BINS>
+sliding_histogram<BINS>::~sliding_histogram()
+{
+    if(m_columns)
+    {
+        stats_track_memory(STATS_MEMORY_HISTOGRAM,
+                           -ptrdiff_t(m_max_width * BINS * sizeof(uint16_t)));
+        delete [] m_columns;
+    }
+    if(m_pixels)
+    {
+        delete [] m_pixels;
+    }
+}
+
+template <uint32_t BINS>
+void
+sliding_histogram<BINS>::Reset(const ImageView &img, int32_t x0, int32_t y0,
+                               uint32_t width, uint32_t window,
+                               uint32_t channel)
+{
+    if(width > m_max_width)
+    {
+        width = m_max_width;
+    }
 
-        c = get_pixel(x2, y2);
+    m_img = img;
+    m_x0 = x0;
+    m_y = y0;
+    m_width = width;
+    m_window = window;
+    m_channel = channel;
+    m_x = 0;
 
-        if(x1 && y1)
+    memset(m_columns, 0, width * BINS * sizeof(uint16_t));
+
+    for(uint32_t y=0; y<window; y++)
+    {
+        AddRow(y0 + int32_t(y), 1);
+    }
+}
+
+template <uint32_t BINS>
+void
+sliding_histogram<BINS>::AddRow(int32_t y, int32_t delta)
+{
+    const uint8_t *in(m_pixels);
+    uint16_t *column(m_columns);
+
+    m_img.get_constrained_row(m_x0, y, m_width, m_channel, m_pixels);
+
+    for(uint32_t x=0; x<m_width; x++)
+    {
+        column[(*in) / (256 / BINS)]+= delta;
+        in++;
+        column+= BINS;
+    }
+}
+
+template <uint32_t BINS>
+void
+sliding_histogram<BINS>::NextRow(void)
+{
+    AddRow(m_y, -1);
+    AddRow(m_y + m_window, 1);
+    m_y++;
+    m_x = 0;
+}
+
+template <uint32_t BINS>
+void
+sliding_histogram<BINS>::FirstWindow(uint32_t *result)
+{
+    const uint16_t *column(m_columns);
+
+    for(uint32_t i=0; i<BINS; i++)
+    {
+        result[i] = 0;
+    }
+    for(uint32_t x=0; (x<m_window) && (x<m_width); x++)
+    {
+        for(uint32_t i=0; i<BINS; i++)
         {
-            a = get_pixel(x1 - 1, y1 - 1);
+            result[i]+= column[i];
         }
-        if(x1)
+        column+= BINS;
+    }
+    m_x = 0;
+}
+
+template <uint32_t BINS>
+void
+sliding_histogram<BINS>::NextWindow(uint32_t *result)
+{
+    if((m_x + m_window) < m_width)
+    {
+        const uint16_t *outgoing, *incoming;
+
+        outgoing = m_columns + (m_x * BINS);
+        incoming = m_columns + ((m_x + m_window) * BINS);
+
+        for(uint32_t i=0; i<BINS; i++)
+        {
+            result[i]+= incoming[i];
+            result[i]-= outgoing[i];
+        }
+        m_x++;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+template <typename T, uint32_t BINS>
+joint_sliding_histogram<T, BINS>::joint_sliding_histogram(uint32_t max_width)
+    : m_columns(NULL)
+    , m_pixels(NULL)
+    , m_max_width(max_width)
+    , m_x0(0), m_y(0), m_width(0), m_window(0), m_guide(0)
+    , m_x(0)
+{
+    m_columns = new T[max_width * PLANES * BINS];
+    m_pixels = new uint8_t[max_width * CHANNELS];
+    stats_track_memory(STATS_MEMORY_HISTOGRAM,
+                       max_width * PLANES * BINS * sizeof(T));
+}
+
+template <typename T, uint32_t BINS>
+joint_sliding_histogram<T, BINS>::~joint_sliding_histogram()
+{
+    if(m_columns)
+    {
+        stats_track_memory(STATS_MEMORY_HISTOGRAM,
+                           -ptrdiff_t(m_max_width * PLANES * BINS * sizeof(T)));
+        delete [] m_columns;
+    }
+    if(m_pixels)
+    {
+        delete [] m_pixels;
+    }
+}
+
+template <typename T, uint32_t BINS>
+void
+joint_sliding_histogram<T, BINS>::Reset(const ImageView &img, int32_t x0, int32_t y0,
+                                     uint32_t width, uint32_t window,
+                                     uint32_t guide)
+{
+    if(width > m_max_width)
+    {
+        width = m_max_width;
+    }
+
+    m_img = img;
+    m_x0 = x0;
+    m_y = y0;
+    m_width = width;
+    m_window = window;
+    m_guide = guide;
+    m_x = 0;
+
+    memset(m_columns, 0, width * PLANES * BINS * sizeof(T));
+
+    for(uint32_t y=0; y<window; y++)
+    {
+        AddRow(y0 + int32_t(y), 1);
+    }
+}
+
+// The channels of the row are fetched one after another and then read side
+// by side, so the reflected border is handled once per channel rather than
+// once per pixel.  Removing a row adds the two's complement of its values,
+// which wraps back to the right sums.
+template <typename T, uint32_t BINS>
+void
+joint_sliding_histogram<T, BINS>::AddRow(int32_t y, int32_t delta)
+{
+    const uint8_t *in[CHANNELS];
+    T *column(m_columns);
+
+    for(uint32_t c=0; c<CHANNELS; c++)
+    {
+        in[c] = m_pixels + (c * m_width);
+        m_img.get_constrained_row(m_x0, y, m_width, c, m_pixels + (c * m_width));
+    }
+
+    for(uint32_t x=0; x<m_width; x++)
+    {
+        uint8_t pixel[CHANNELS];
+        uint32_t bin;
+
+        for(uint32_t c=0; c<CHANNELS; c++)
         {
-            d = get_pixel(x1 - 1, y2);
+            pixel[c] = in[c][x];
         }
-        if(y1)
+        bin = get_guide(pixel, m_guide) / (256 / BINS);
+
+        column[bin]+= delta;
+        for(uint32_t c=0; c<CHANNELS; c++)
         {
-            b = get_pixel(x2, y1 - 1);
+            column[((c + 1) * BINS) + bin]+= delta * int32_t(pixel[c]);
         }
+        column+= PLANES * BINS;
+    }
+}
 
-        // calculate histogram.
-        // TODO: optimise
-        for(i=0; i<get_channels(); i++)
+template <typename T, uint32_t BINS>
+void
+joint_sliding_histogram<T, BINS>::NextRow(void)
+{
+    AddRow(m_y, -1);
+    AddRow(m_y + m_window, 1);
+    m_y++;
+    m_x = 0;
+}
+
+template <typename T, uint32_t BINS>
+void
+joint_sliding_histogram<T, BINS>::FirstWindow(uint32_t *result)
+{
+    const T *column(m_columns);
+
+    for(uint32_t i=0; i<(PLANES * BINS); i++)
+    {
+        result[i] = 0;
+    }
+    for(uint32_t x=0; (x<m_window) && (x<m_width); x++)
+    {
+        for(uint32_t i=0; i<(PLANES * BINS); i++)
         {
-            if(a) result[i]+=a[i];
-            if(c) result[i]+=c[i];
-            if(b) result[i]-=b[i];
-            if(d) result[i]-=d[i];
+            result[i]+= column[i];
         }
+        column+= PLANES * BINS;
     }
+    m_x = 0;
 }
 
+template <typename T, uint32_t BINS>
+void
+joint_sliding_histogram<T, BINS>::NextWindow(uint32_t *result)
+{
+    if((m_x + m_window) < m_width)
+    {
+        const T *outgoing, *incoming;
+
+        outgoing = m_columns + (m_x * PLANES * BINS);
+        incoming = m_columns + ((m_x + m_window) * PLANES * BINS);
+
+        for(uint32_t i=0; i<(PLANES * BINS); i++)
+        {
+            result[i]+= incoming[i];
+            result[i]-= outgoing[i];
+        }
+        m_x++;
+    }
+}
+
+#define INSTANTIATE_HISTOGRAMS(BINS) \
+    template class integral_histogram<uint32_t, BINS>; \
+    template class integral_histogram<uint16_t, BINS>; \
+    template class slab_integral_histogram<uint32_t, BINS>; \
+    template class slab_integral_histogram<uint16_t, BINS>; \
+    template class rolling_integral_histogram<uint32_t, BINS>; \
+    template class rolling_integral_histogram<uint16_t, BINS>; \
+    template class sliding_histogram<BINS>; \
+    template class joint_sliding_histogram<uint32_t, BINS>; \
+    template class joint_sliding_histogram<uint16_t, BINS>;
+
+INSTANTIATE_HISTOGRAMS(8)
+INSTANTIATE_HISTOGRAMS(16)
+INSTANTIATE_HISTOGRAMS(32)
+INSTANTIATE_HISTOGRAMS(64)
+INSTANTIATE_HISTOGRAMS(128)
+INSTANTIATE_HISTOGRAMS(256)
+
 }
@@ -4,63 +4,267 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+
+#include "stats.h"
 
 //#include "stm_export.h"
 
 namespace spectral
 {
 
-// Generic image template.
+// Buffers are aligned to IMAGE_ALIGNMENT bytes, so that the rows of images
+// with padded rows, and entries of that size or larger, never straddle a
+// cache line more than they have to.
+enum { IMAGE_ALIGNMENT = 64 };
+
+// How an image's buffer is filled, and whether its rows are padded out to a
+// multiple of IMAGE_ALIGNMENT bytes.  Images with padded rows must be
+// walked with get_stride() rather than width x channels.
+enum image_flags
+{
+    IMAGE_ZERO = 0,             // zero (or copy) fill the buffer
+    IMAGE_NO_INIT = 1,          // leave it for the owner to fill in
+    IMAGE_PAD_ROWS = 2
+};
+
+// Where image buffers come from.  All the allocators give IMAGE_ALIGNMENT
+// aligned memory; the huge page one also asks the kernel to back large
+// buffers with huge pages, which suits integral histograms, as they are
+// walked end to end and are far bigger than the TLB reaches with small
+// pages.  The histogram one is the huge page one, but keeps released
+// buffers to hand out again until drain_histogram_allocator returns them to
+// the system.
+class image_allocator
+{
+public:
+    virtual ~image_allocator() {}
+
+    virtual void *allocate(size_t bytes) = 0;
+    virtual void release(void *buffer, size_t bytes) = 0;
+};
+
+image_allocator *get_default_allocator(void);
+image_allocator *get_huge_page_allocator(void);
+image_allocator *get_histogram_allocator(void);
+void drain_histogram_allocator(void);
+
+template <typename T> class image;
+
+// A window onto pixels held elsewhere: an image, part of one, or a buffer
+// that belongs to someone else, such as a gimp tile.  Pixels are channels
+// elements apart and rows stride elements apart.  Views own nothing, so
+// they are cheap to pass by value, and must not outlive what they look at.
 template <typename T>
-class image
+class image_view
 {
 public:
-    image(uint32_t width,
-          uint32_t height,
-          uint32_t channels = 1,
-          const T *buf = NULL)
-        : m_buffer(NULL)
+    image_view()
+        : m_data(NULL)
+        , m_width(0)
+        , m_height(0)
+        , m_channels(0)
+        , m_stride(0)
+    {
+    }
+
+    image_view(T *data, uint32_t width, uint32_t height,
+               uint32_t channels, size_t stride)
+        : m_data(data)
         , m_width(width)
         , m_height(height)
         , m_channels(channels)
+        , m_stride(stride)
     {
-        uint32_t size = width * height * channels;
+    }
 
-        if(size)
+    // The whole of img.
+    image_view(const image<T> &img);
+
+    // The part of this view with its top left corner at (x, y), cut short
+    // where it would run off the edge.
+    image_view get_view(uint32_t x, uint32_t y,
+                        uint32_t width, uint32_t height) const
+    {
+        x = (x < m_width) ? x : m_width;
+        y = (y < m_height) ? y : m_height;
+        width = ((m_width - x) < width) ? (m_width - x) : width;
+        height = ((m_height - y) < height) ? (m_height - y) : height;
+        return image_view(get_pixel(x, y), width, height, m_channels, m_stride);
+    }
+
+    T *get_row(uint32_t y) const
+    {
+        return m_data + ((size_t)y * m_stride);
+    }
+    T *get_pixel(uint32_t x, uint32_t y) const
+    {
+        return get_row(y) + ((size_t)x * m_channels);
+    }
+    uint32_t get_width(void) const
+    {
+        return m_width;
+    }
+    uint32_t get_height(void) const
+    {
+        return m_height;
+    }
+    uint32_t get_channels(void) const
+    {
+        return m_channels;
+    }
+    size_t get_stride(void) const
+    {
+        return m_stride;
+    }
+
+    // Copy as much of src as fits into the top left of this view.  Both must
+    // have the same number of channels.
+    void copy_from(const image_view &src) const
+    {
+        uint32_t width((src.m_width < m_width) ? src.m_width : m_width);
+        uint32_t height((src.m_height < m_height) ? src.m_height : m_height);
+
+        for(uint32_t y=0; y<height; y++)
         {
-            m_buffer = new T[size];
+            memcpy(get_row(y), src.get_row(y), (size_t)width * m_channels * sizeof(T));
+        }
+    }
+
+    // Copy one channel of a run of pixels from row y, starting at column x,
+    // into out.  Coordinates outside the view are reflected or wrapped back
+    // in, but only the parts of the run that actually fall outside pay for
+    // it.  This gives a virtual border without making an expanded copy.
+    void get_constrained_row(int32_t x, int32_t y,
+                             uint32_t width, uint32_t channel, T *out,
+                             bool wrap_x = false, bool wrap_y = false) const
+    {
+        const T *row;
+        uint32_t i(0);
+
+        y = wrap_y ? constrain_wrap(y, m_height) : constrain_reflect(y, m_height);
+        row = get_row(y) + channel;
 
-            if(buf && m_buffer)
+        // Left hand border.
+        for(; (i < width) && ((x + int32_t(i)) < 0); i++)
+        {
+            int32_t xx = x + int32_t(i);
+            xx = wrap_x ? constrain_wrap(xx, m_width) : constrain_reflect(xx, m_width);
+            out[i] = row[xx * m_channels];
+        }
+        // Inside the view.
+        if(i < width)
+        {
+            const T *in = row + ((x + int32_t(i)) * m_channels);
+            for(; (i < width) && ((x + int32_t(i)) < int32_t(m_width)); i++)
             {
-                for(uint32_t i=0; i<size; i++)
-                {
-                    m_buffer[i] = buf[i];
-                }
+                out[i] = *in;
+                in+= m_channels;
             }
-            else if(m_buffer)
+        }
+        // Right hand border.
+        for(; i < width; i++)
+        {
+            int32_t xx = x + int32_t(i);
+            xx = wrap_x ? constrain_wrap(xx, m_width) : constrain_reflect(xx, m_width);
+            out[i] = row[xx * m_channels];
+        }
+    }
+
+    // Bring a coordinate outside 0 to extent - 1 back inside.
+    static int constrain_reflect(int x, uint32_t extent)
+    {
+        extent--;
+
+        if(extent)
+        {
+            x = abs(x);
+
+            while(uint32_t(x) > extent)
             {
-                for(uint32_t i=0; i<size; i++)
-                {
-                    m_buffer[i] = 0;
-                }
+                x = abs((int)(2 * extent) - (int)x);
             }
         }
+        else
+        {
+            // A single pixel reflects onto itself.
+            x = 0;
+        }
+        return x;
     }
 
-    virtual ~image()
+    static int constrain_wrap(int x, uint32_t extent)
     {
-        if(m_buffer)
+        if(extent)
         {
-            delete [] m_buffer;
+            while(x < 0)
+            {
+                x+= extent;
+            }
+            while(x >= (int32_t)extent)
+            {
+                x-= extent;
+            }
         }
+        return x;
+    }
+
+private:
+    T *m_data;
+    uint32_t m_width, m_height, m_channels;
+    size_t m_stride;            // elements per row
+};
+
+// Generic image template.
+template <typename T>
+class image
+{
+public:
+    image(uint32_t width,
+          uint32_t height,
+          uint32_t channels = 1,
+          const T *buf = NULL)
+        : m_buffer(NULL)
+        , m_width(width)
+        , m_height(height)
+        , m_channels(channels)
+        , m_stride(0)
+        , m_capacity(0)
+        , m_flags(IMAGE_ZERO)
+        , m_allocator(get_default_allocator())
+    {
+        allocate(buf);
+    }
+
+    // As above, but with control over how the buffer is filled and laid
+    // out, and where it comes from.
+    image(uint32_t width,
+          uint32_t height,
+          uint32_t channels,
+          image_flags flags,
+          image_allocator *allocator = NULL)
+        : m_buffer(NULL)
+        , m_width(width)
+        , m_height(height)
+        , m_channels(channels)
+        , m_stride(0)
+        , m_capacity(0)
+        , m_flags(flags)
+        , m_allocator(allocator ? allocator : get_default_allocator())
+    {
+        allocate(NULL);
+    }
+
+    virtual ~image()
+    {
+        release();
     }
 
     size_t get_index(uint32_t x, uint32_t y) const
     {
         if((x < m_width) && (y < m_height))
         {
-            uint32_t idx = x + (y * m_width);
-            return (size_t)(idx * m_channels);
+            return ((size_t)y * m_stride) + ((size_t)x * m_channels);
         }
         return (size_t)(-1);
     }
@@ -87,24 +291,40 @@ public:
 
         if(wrap_x)
         {
-            xx = constrain_wrap(xx, m_width);
+            xx = image_view<T>::constrain_wrap(xx, m_width);
         }
         else
         {
-            xx = constrain_reflect(xx, m_width);
+            xx = image_view<T>::constrain_reflect(xx, m_width);
         }
         if(wrap_y)
         {
-            yy = constrain_wrap(yy, m_height);
+            yy = image_view<T>::constrain_wrap(yy, m_height);
         }
         else
         {
-            yy = constrain_reflect(yy, m_height);
+            yy = image_view<T>::constrain_reflect(yy, m_height);
         }
 
         return get_pixel(xx, yy);
     }
 
+    // As image_view::get_constrained_row.
+    void get_constrained_row(int32_t x, int32_t y,
+                             uint32_t width, uint32_t channel, T *out,
+                             bool wrap_x = false, bool wrap_y = false) const
+    {
+        image_view<T>(*this).get_constrained_row(x, y, width, channel, out,
+                                                 wrap_x, wrap_y);
+    }
+
+    // The part of the image with its top left corner at (x, y).
+    image_view<T> get_view(uint32_t x, uint32_t y,
+                           uint32_t width, uint32_t height) const
+    {
+        return image_view<T>(*this).get_view(x, y, width, height);
+    }
+
     T*       get_buffer(void) const
     {
         return m_buffer;
@@ -121,11 +341,21 @@ public:
     {
         return m_channels;
     }
+    // Elements from the start of one row to the next.
+    size_t get_stride(void) const
+    {
+        return m_stride;
+    }
+    // Memory held by the buffer, which may be more than the current size.
+    size_t get_bytes(void) const
+    {
+        return m_capacity * sizeof(T);
+    }
 
     void set_pixel(uint32_t x, uint32_t y, const T *pixel)
     {
         size_t index = get_index(x, y);
-        if(pixel && m_buffer && (index < (m_width * m_height * m_channels)))
+        if(pixel && m_buffer && (index < (m_height * m_stride)))
         {
             for(size_t i=0; i<(size_t)m_channels; i++)
             {
@@ -133,42 +363,99 @@ public:
             }
         }
     }
-private:
+protected:
+    // Change the dimensions of the image in place.  The buffer is only
+    // reallocated when it is too small, and its contents are undefined
+    // afterwards.
+    void reshape(uint32_t width, uint32_t height)
+    {
+        reshape(width, height, m_channels);
+    }
 
-    int constrain_reflect(int x, uint32_t extent) const
+    void reshape(uint32_t width, uint32_t height, uint32_t channels)
     {
-        extent--;
+        size_t stride(row_stride(width, channels));
 
-        if(extent)
+        if((stride * height) > m_capacity)
         {
-            x = abs(x);
+            release();
+            m_buffer = (T *)m_allocator->allocate(stride * height * sizeof(T));
+            m_capacity = stride * height;
+            track_memory(m_capacity);
+        }
+        m_width = width;
+        m_height = height;
+        m_channels = channels;
+        m_stride = stride;
+    }
 
-            while(uint32_t(x) > extent)
-            {
-                x = abs((int)(2 * extent) - (int)x);
-            }
+private:
+    size_t row_stride(uint32_t width, uint32_t channels) const
+    {
+        size_t stride((size_t)width * channels);
+
+        if(m_flags & IMAGE_PAD_ROWS)
+        {
+            const size_t align(IMAGE_ALIGNMENT / sizeof(T));
+            stride = (stride + align - 1) & ~(align - 1);
         }
-        return x;
+        return stride;
     }
 
-    int constrain_wrap(int x, uint32_t extent) const
+    void allocate(const T *buf)
     {
-        if(extent)
+        size_t size;
+
+        m_stride = row_stride(m_width, m_channels);
+        size = m_stride * m_height;
+        if(size)
         {
-            while(x < 0)
+            m_buffer = (T *)m_allocator->allocate(size * sizeof(T));
+            m_capacity = size;
+            track_memory(m_capacity);
+
+            if(buf)
             {
-                x+= extent;
+                size_t row((size_t)m_width * m_channels);
+
+                for(uint32_t y=0; y<m_height; y++)
+                {
+                    memcpy(m_buffer + (y * m_stride), buf + (y * row),
+                           row * sizeof(T));
+                }
             }
-            while(x >= (int32_t)extent)
+            else if(!(m_flags & IMAGE_NO_INIT))
             {
-                x-= extent;
+                memset(m_buffer, 0, size * sizeof(T));
             }
         }
-        return x;
+    }
+
+    void release(void)
+    {
+        if(m_buffer)
+        {
+            track_memory(-ptrdiff_t(m_capacity));
+            m_allocator->release(m_buffer, m_capacity * sizeof(T));
+            m_buffer = NULL;
+            m_capacity = 0;
+        }
+    }
+
+    // Only 8 bit images hold pixels; wider ones are histograms.
+    void track_memory(ptrdiff_t size) const
+    {
+        stats_track_memory((sizeof(T) == 1) ? STATS_MEMORY_IMAGE
+                                            : STATS_MEMORY_HISTOGRAM,
+                           size * ptrdiff_t(sizeof(T)));
     }
 
     T *m_buffer;
     uint32_t m_width, m_height, m_channels;
+    size_t m_stride;            // elements per row
+    size_t m_capacity;          // elements allocated
+    image_flags m_flags;
+    image_allocator *m_allocator;
 };
 
 // 8 bit image.
@@ -179,35 +466,409 @@ public:
     Image(const Image &);
     virtual ~Image();
 
-    // Expand an image, adding a reflected border.
-    Image *Expand(uint32_t x_border, uint32_t y_border,
-                  bool wrap_x, bool wrap_y) const;
-
     Image *Contract(uint32_t x_border, uint32_t y_border) const;
 
 private:
 };
 
-class IntegralHistogram : public image<uint32_t>
+template <typename T>
+image_view<T>::image_view(const image<T> &img)
+    : m_data(img.get_buffer())
+    , m_width(img.get_width())
+    , m_height(img.get_height())
+    , m_channels(img.get_channels())
+    , m_stride(img.get_stride())
+{
+}
+
+// View of 8 bit pixels, which an Image converts to, so that anything taking
+// one works on a whole image as well as on part of one or a foreign buffer.
+typedef image_view<uint8_t> ImageView;
+
+// Histograms have a fixed number of BINS, each covering 256 / BINS input
+// values, so that the bin arithmetic is constant folded.  They are
+// instantiated for 8, 16, 32, 64, 128 and 256 bins.
+
+// Integral histogram, storing per-bin counts of T.  The counts for a window
+// are taken as the difference of four corner entries, which is exact in
+// modular arithmetic as long as no window holds more pixels than T can count,
+// so narrower types may be used for smaller windows even though the stored
+// prefix sums wrap.
+//
+// A histogram may hold just a span of its bins, for a region whose values all
+// fall inside it, in which case only those bins are stored and built.  Spans
+// are 8 to BINS bins, a power of two, starting on a multiple of 8.
+//
+// Entries are stored with a leading row and column of zeros, so entry
+// (x, y) holds the counts for the pixels above and to the left of (x, y) in
+// the region, and the four corners of every window exist.  The image is
+// therefore one bigger each way than the region.
+template <typename T, uint32_t BINS>
+class integral_histogram : public image<T>
 {
 public:
-    IntegralHistogram(uint32_t bins, const Image &img, uint32_t channel);
+    typedef T value_type;
+
+    integral_histogram(const ImageView &img, uint32_t channel);
 
-    IntegralHistogram(uint32_t bins, const Image &img, uint32_t x0, uint32_t y0,
-                      uint32_t width, uint32_t height, uint32_t channel);
+    // Histogram of the region of img with its top left corner at (x0, y0).
+    // The region may extend past the edges of img, which are reflected.
+    integral_histogram(const ImageView &img, int32_t x0, int32_t y0,
+                       uint32_t width, uint32_t height, uint32_t channel);
 
+    // Empty histogram with room for a width x height region, to be filled
+    // in later by Rebuild.
+    integral_histogram(uint32_t width, uint32_t height);
 
-    virtual ~IntegralHistogram();
+    virtual ~integral_histogram();
 
     void GetHistogram(uint32_t x1, uint32_t y1,
                       uint32_t x2, uint32_t y2,
                       uint32_t *result) const;
+
+    // Fast path for square windows in raster order.  GetRows finds the rows
+    // of entries along the top and bottom edges of the windows whose top
+    // left pixel is in row y.  The window whose top left pixel is at column
+    // x has its left hand corners at top and bottom advanced by x *
+    // get_span(), and GetWindow gives its counts for the bins held.  Windows
+    // must lie inside the region.
+    void GetRows(uint32_t y, uint32_t window,
+                 const T *&top, const T *&bottom) const
+    {
+        top = this->get_pixel(0, y);
+        bottom = this->get_pixel(0, y + window);
+    }
+
+    void GetWindow(const T *top, const T *bottom, uint32_t window,
+                   uint32_t *result) const
+    {
+        size_t right(size_t(window) * get_span());
+
+        m_combine(top, top + right, bottom + right, bottom, result);
+    }
+
+    // Rebuild the histogram for a new region of an image, reusing the
+    // existing buffer where possible.  Every value in the region must fall
+    // in the span of bins starting at first_bin.
+    void Rebuild(const ImageView &img, int32_t x0, int32_t y0,
+                 uint32_t width, uint32_t height, uint32_t channel,
+                 uint32_t first_bin = 0, uint32_t span = BINS);
+
+    // The bins held.  GetHistogram gives zero counts for any others.
+    uint32_t get_first_bin(void) const
+    {
+        return m_first_bin;
+    }
+    uint32_t get_span(void) const
+    {
+        return this->get_channels();
+    }
+
+    // The smallest span of bins, as above, covering values lo to hi.
+    static void get_span_for(uint8_t lo, uint8_t hi,
+                             uint32_t &first_bin, uint32_t &span)
+    {
+        uint32_t lo_bin(lo / (256 / BINS)), hi_bin(hi / (256 / BINS));
+
+        span = 8;
+        first_bin = lo_bin & ~7U;
+        while((first_bin + span) <= hi_bin)
+        {
+            span*= 2;
+            if((first_bin + span) > BINS)
+            {
+                first_bin = BINS - span;
+            }
+        }
+    }
+
+    // The largest window, in pixels, that can be queried exactly.
+    static uint32_t max_window_area(void)
+    {
+        return (uint32_t)(T)(-1);
+    }
+
+    // Bins per plane, for telling layouts apart; 0 as this one is pixel
+    // major.
+    static uint32_t get_layout(void)
+    {
+        return 0;
+    }
 private:
-    void BuildHistogram(uint32_t bins, const Image &img,
-                        uint32_t x0, uint32_t y0,
+    void BuildHistogram(const ImageView &img,
+                        int32_t x0, int32_t y0,
                         uint32_t width, uint32_t height,
                         uint32_t channel);
 
+    // result = c - b - d + a for corners a-----b, over the bins held.
+    //                                     |     |
+    //                                     d-----c
+    typedef void (*combine_fun)(const T *a, const T *b, const T *c,
+                                const T *d, uint32_t *result);
+
+    uint32_t m_first_bin;
+    combine_fun m_combine;
+};
+
+// Integral histogram stored bin major, as one integral plane for each slab of
+// SLAB bins, so that a query which only needs the bins near some value reads
+// just the planes that hold them, rather than every bin of four entries that
+// each span several cache lines.  Otherwise it is as integral_histogram,
+// spans and zero border included.  The planes are stacked one above the
+// other in the image, each one SLAB channels wide.
+template <typename T, uint32_t BINS>
+class slab_integral_histogram : public image<T>
+{
+public:
+    typedef T value_type;
+
+    enum { SLAB = 8 };
+
+    // Empty histogram with room for a width x height region, to be filled
+    // in later by Rebuild.
+    slab_integral_histogram(uint32_t width, uint32_t height);
+    virtual ~slab_integral_histogram();
+
+    void GetHistogram(uint32_t x1, uint32_t y1,
+                      uint32_t x2, uint32_t y2,
+                      uint32_t *result) const;
+
+    // As for integral_histogram, with top and bottom in the plane of the
+    // first slab held.  GetSlabs gives the counts for the slabs held from
+    // first to last - 1, starting at result.
+    void GetRows(uint32_t y, uint32_t window,
+                 const T *&top, const T *&bottom) const
+    {
+        top = this->get_pixel(0, y);
+        bottom = this->get_pixel(0, y + window);
+    }
+
+    void GetSlabs(const T *top, const T *bottom, uint32_t window,
+                  uint32_t first, uint32_t last, uint32_t *result) const
+    {
+        size_t right(size_t(window) * SLAB);
+
+        top+= first * m_plane_size;
+        bottom+= first * m_plane_size;
+        for(uint32_t s=first; s<last; s++)
+        {
+            m_combine(top, top + right, bottom + right, bottom, result);
+            top+= m_plane_size;
+            bottom+= m_plane_size;
+            result+= SLAB;
+        }
+    }
+
+    void Rebuild(const ImageView &img, int32_t x0, int32_t y0,
+                 uint32_t width, uint32_t height, uint32_t channel,
+                 uint32_t first_bin = 0, uint32_t span = BINS);
+
+    uint32_t get_first_bin(void) const
+    {
+        return m_first_bin;
+    }
+    uint32_t get_span(void) const
+    {
+        return m_span;
+    }
+
+    static void get_span_for(uint8_t lo, uint8_t hi,
+                             uint32_t &first_bin, uint32_t &span)
+    {
+        integral_histogram<T, BINS>::get_span_for(lo, hi, first_bin, span);
+    }
+
+    static uint32_t max_window_area(void)
+    {
+        return (uint32_t)(T)(-1);
+    }
+
+    static uint32_t get_layout(void)
+    {
+        return SLAB;
+    }
+private:
+    void BuildHistogram(const ImageView &img,
+                        int32_t x0, int32_t y0,
+                        uint32_t width, uint32_t height,
+                        uint32_t channel);
+
+    typedef void (*combine_fun)(const T *a, const T *b, const T *c,
+                                const T *d, uint32_t *result);
+
+    uint32_t m_first_bin, m_span;
+    size_t m_plane_size;        // entries in each plane
+    combine_fun m_combine;
+};
+
+// Integral histogram of a band of rows, holding only the window + 1 rows that
+// a square window query touches.  Rows are built one at a time as the window
+// moves down, so each one is used while it is still in cache.  As with
+// integral_histogram, counts of T are exact for windows of up to
+// max_window_area() pixels.
+template <typename T, uint32_t BINS>
+class rolling_integral_histogram
+{
+public:
+    rolling_integral_histogram(uint32_t max_width, uint32_t max_window);
+    ~rolling_integral_histogram();
+
+    // Start a new pass over a region width columns wide, with a square
+    // window whose top left corner is at (x0, y0).  The region may extend
+    // past the edges of img, which are reflected.
+    void Reset(const ImageView &img, int32_t x0, int32_t y0,
+               uint32_t width, uint32_t window, uint32_t channel);
+
+    // Move the window down one row, building the row that comes into view.
+    void NextRow(void);
+
+    // Histogram of the window in the current row spanning columns x1 to x2
+    // inclusive.
+    void GetHistogram(uint32_t x1, uint32_t x2, uint32_t *result) const;
+
+    static uint32_t max_window_area(void)
+    {
+        return (uint32_t)(T)(-1);
+    }
+
+    // Bytes needed to hold the rows for a region and window size.
+    static size_t ring_size(uint32_t width, uint32_t window)
+    {
+        return (size_t)(window + 1) * width * BINS * sizeof(T);
+    }
+private:
+    T *get_row(uint32_t k) const
+    {
+        return m_rows + ((size_t)(k % (m_window + 1)) * m_width * BINS);
+    }
+
+    void BuildRow(uint32_t k);
+
+    T *m_rows;
+    T m_row_sum[BINS];
+    uint8_t *m_pixels;
+    uint32_t m_max_width, m_max_window;
+
+    ImageView m_img;
+    int32_t m_x0, m_y0;
+    uint32_t m_width, m_window, m_channel;
+
+    // Integral row k covers image rows y0 to y0 + k - 1, so row 0 is zero.
+    // The current window lies between rows m_top and m_top + m_window.
+    uint32_t m_top;
+};
+
+// Sliding window histogram, after Perreault & Hebert.  One histogram is kept
+// for each column of the window height, plus the histogram of the current
+// window.  Moving the window right adds one column and removes another, and
+// moving down updates every column by one pixel, so box histograms come out in
+// raster order at constant cost per pixel using O(width x bins) memory.
+template <uint32_t BINS>
+class sliding_histogram
+{
+public:
+    sliding_histogram(uint32_t max_width);
+    ~sliding_histogram();
+
+    // Start a new pass over a region width columns wide, with a square
+    // window whose top left corner is at (x0, y0).  The region may extend
+    // past the edges of img, which are reflected.
+    void Reset(const ImageView &img, int32_t x0, int32_t y0,
+               uint32_t width, uint32_t window, uint32_t channel);
+
+    // Move the window down one row, back to the left hand edge.
+    void NextRow(void);
+
+    // Histogram of the leftmost window in the current row.
+    void FirstWindow(uint32_t *result);
+
+    // Move the window right one column, updating result in place.  result
+    // must hold the histogram of the previous window.
+    void NextWindow(uint32_t *result);
+
+private:
+    void AddRow(int32_t y, int32_t delta);
+
+    uint16_t *m_columns;
+    uint8_t *m_pixels;
+    uint32_t m_max_width;
+
+    ImageView m_img;
+    int32_t m_x0, m_y;
+    uint32_t m_width, m_window, m_channel;
+    uint32_t m_x;
+};
+
+// What every joint_sliding_histogram has in common, whatever its bins.
+class joint_histogram_base
+{
+public:
+    enum
+    {
+        CHANNELS = 3,
+        PLANES = CHANNELS + 1,
+        LUMA = CHANNELS         // guide on luma rather than a channel
+    };
+
+    // Guide value of a pixel, which must have at least CHANNELS channels.
+    static uint8_t get_guide(const uint8_t *pixel, uint32_t guide)
+    {
+        if(guide < CHANNELS)
+        {
+            return pixel[guide];
+        }
+        // Rec. 601 weights, in 8 bit fixed point.
+        return ((77 * pixel[0]) + (150 * pixel[1]) + (29 * pixel[2]) + 128) >> 8;
+    }
+
+    static uint32_t max_window_area(void)
+    {
+        return 0x7fffffffU / 255;
+    }
+};
+
+// Sliding window histogram of a guide over the first CHANNELS channels of an
+// image, for filtering the colour channels together.  Pixels are binned by
+// their guide value, which is either one of the channels or their luma, and
+// each bin holds the number of pixels in it followed by the sum of each
+// channel over them.  The bins are stored as PLANES runs of BINS: the counts,
+// then the sums for each channel in turn.  Columns hold their counts and sums
+// in T, which limits their height to max_window_height(); windows total them
+// in 32 bits, exactly and without overflowing a signed int as long as they
+// hold no more than max_window_area() pixels.
+template <typename T, uint32_t BINS>
+class joint_sliding_histogram : public joint_histogram_base
+{
+public:
+    joint_sliding_histogram(uint32_t max_width);
+    ~joint_sliding_histogram();
+
+    // As for sliding_histogram, with guide being a channel below CHANNELS or
+    // LUMA.
+    void Reset(const ImageView &img, int32_t x0, int32_t y0,
+               uint32_t width, uint32_t window, uint32_t guide);
+
+    void NextRow(void);
+
+    // result must hold PLANES * BINS entries.
+    void FirstWindow(uint32_t *result);
+    void NextWindow(uint32_t *result);
+
+    static uint32_t max_window_height(void)
+    {
+        return (uint32_t)(T)(-1) / 255;
+    }
+private:
+    void AddRow(int32_t y, int32_t delta);
+
+    T *m_columns;
+    uint8_t *m_pixels;
+    uint32_t m_max_width;
+
+    ImageView m_img;
+    int32_t m_x0, m_y;
+    uint32_t m_width, m_window, m_guide;
+    uint32_t m_x;
 };
 
 }
@@ -32,6 +32,7 @@
 
 #include "main.h"
 #include "interface.h"
+#include "bilateral.h"
 
 #include "plugin-intl.h"
 
@@ -47,12 +48,25 @@
 
 static gboolean   dialog_image_constraint_func (gint32    image_id,
         gpointer  data);
+static void       dialog_response              (GtkWidget   *widget,
+                                                gint         response_id,
+                                                gpointer     data);
+static void       preview_invalidated          (GimpPreview *preview,
+                                                gpointer     data);
+static gboolean   preview_idle                 (gpointer     data);
 
 
 /*  Local variables  */
 
 static PlugInUIVals *ui_state = NULL;
 
+/*  The preview is rendered from an idle handler, so that a render never
+ *  starts inside another one that is handling events while it runs.
+ */
+static bilateral_preview *preview_state = NULL;
+static PlugInVals        *preview_vals  = NULL;
+static guint              preview_idle_id = 0;
+
 
 /*  Public functions  */
 
@@ -62,7 +76,8 @@ dialog (gint32              image_ID,
         PlugInVals         *vals,
         PlugInImageVals    *image_vals,
         PlugInDrawableVals *drawable_vals,
-        PlugInUIVals       *ui_vals)
+        PlugInUIVals       *ui_vals,
+        gboolean            enhance)
 {
     GtkWidget *dlg;
     GtkWidget *main_vbox;
@@ -71,10 +86,12 @@ dialog (gint32              image_ID,
     //GtkWidget *checkbox;
     //GtkWidget *hbox2;
     //GtkWidget *coordinates;
-    //GtkWidget *combo;
+    GtkWidget *combo;
+    GtkWidget *preview;
     GtkObject *adj;
     gint       row;
     gboolean   run = FALSE;
+    const gchar *title;
     //GimpUnit   unit;
     //gdouble    xres, yres;
 
@@ -82,9 +99,14 @@ dialog (gint32              image_ID,
 
     gimp_ui_init (PLUGIN_NAME, TRUE);
 
-    dlg = gimp_dialog_new (_("Simple Bilateral Filter"), PLUGIN_NAME,
+    /*  Detail enhancement shares the dialog, with a contrast control added  */
+
+    title = enhance ? _("Enhance Details") : _("Simple Bilateral Filter");
+
+    dlg = gimp_dialog_new (title, PLUGIN_NAME,
                            NULL, 0,
-                           gimp_standard_help_func, "bilateral-filter",
+                           gimp_standard_help_func,
+                           enhance ? "bilateral-enhance" : "bilateral-filter",
 
                            GTK_STOCK_CANCEL, GTK_RESPONSE_CANCEL,
                            GTK_STOCK_OK,     GTK_RESPONSE_OK,
@@ -95,13 +117,28 @@ dialog (gint32              image_ID,
     gtk_container_set_border_width (GTK_CONTAINER (main_vbox), 12);
     gtk_container_add (GTK_CONTAINER (GTK_DIALOG (dlg)->vbox), main_vbox);
 
+    /*  Only the visible part of the drawable is filtered for the preview  */
+
+    preview_state = bilateral_preview_new (drawable, enhance);
+    preview_vals  = vals;
+
+    preview = gimp_drawable_preview_new (drawable, &ui_vals->preview);
+    gtk_box_pack_start (GTK_BOX (main_vbox), preview, TRUE, TRUE, 0);
+    gtk_widget_show (preview);
+    g_signal_connect (preview, "invalidated",
+                      G_CALLBACK (preview_invalidated),
+                      NULL);
+    g_signal_connect (dlg, "response",
+                      G_CALLBACK (dialog_response),
+                      NULL);
+
     /*  gimp_scale_entry_new() examples  */
 
-    frame = gimp_frame_new (_("Simple Bilateral Filter"));
+    frame = gimp_frame_new (title);
     gtk_box_pack_start (GTK_BOX (main_vbox), frame, FALSE, FALSE, 0);
     gtk_widget_show (frame);
 
-    table = gtk_table_new (3, 3, FALSE);
+    table = gtk_table_new (4, 3, FALSE);
     gtk_table_set_col_spacings (GTK_TABLE (table), 6);
     gtk_table_set_row_spacings (GTK_TABLE (table), 2);
     gtk_container_add (GTK_CONTAINER (frame), table);
@@ -117,6 +154,9 @@ dialog (gint32              image_ID,
     g_signal_connect (adj, "value_changed",
                       G_CALLBACK (gimp_int_adjustment_update),
                       &vals->radius);
+    g_signal_connect_swapped (adj, "value_changed",
+                              G_CALLBACK (gimp_preview_invalidate),
+                              preview);
 
     adj = gimp_scale_entry_new (GTK_TABLE (table), 0, row++,
                                 _("Threshold:"), SCALE_WIDTH, SPIN_BUTTON_WIDTH,
@@ -126,6 +166,96 @@ dialog (gint32              image_ID,
     g_signal_connect (adj, "value_changed",
                       G_CALLBACK (gimp_int_adjustment_update),
                       &vals->threshold);
+    g_signal_connect_swapped (adj, "value_changed",
+                              G_CALLBACK (gimp_preview_invalidate),
+                              preview);
+
+    if (enhance)
+    {
+        adj = gimp_scale_entry_new (GTK_TABLE (table), 0, row++,
+                                    _("Contrast:"), SCALE_WIDTH, SPIN_BUTTON_WIDTH,
+                                    vals->contrast, 0.0, 10.0, 0.1, 1.0, 1,
+                                    TRUE, 0, 0,
+                                    _("How far detail is pushed"), NULL);
+        g_signal_connect (adj, "value_changed",
+                          G_CALLBACK (gimp_double_adjustment_update),
+                          &vals->contrast);
+        g_signal_connect_swapped (adj, "value_changed",
+                                  G_CALLBACK (gimp_preview_invalidate),
+                                  preview);
+    }
+
+    combo = gimp_int_combo_box_new (_("8 (fastest)"),  8,
+                                    "16",              16,
+                                    "32",              32,
+                                    "64",              64,
+                                    "128",             128,
+                                    _("256 (best)"),   256,
+                                    NULL);
+    gimp_int_combo_box_set_active (GIMP_INT_COMBO_BOX (combo), vals->num_bins);
+    g_signal_connect (combo, "changed",
+                      G_CALLBACK (gimp_int_combo_box_get_active),
+                      &vals->num_bins);
+    g_signal_connect_swapped (combo, "changed",
+                              G_CALLBACK (gimp_preview_invalidate),
+                              preview);
+    gimp_table_attach_aligned (GTK_TABLE (table), 0, row++,
+                               _("Bins:"), 0.0, 0.5,
+                               combo, 2, FALSE);
+
+    /*  Only RGB has colour channels to filter together  */
+
+    if (gimp_drawable_is_rgb (drawable->drawable_id))
+    {
+        combo = gimp_int_combo_box_new (_("Each channel"), FILTER_GUIDE_NONE,
+                                        _("Luma"),         FILTER_GUIDE_LUMA,
+                                        _("Red"),          FILTER_GUIDE_RED,
+                                        _("Green"),        FILTER_GUIDE_GREEN,
+                                        _("Blue"),         FILTER_GUIDE_BLUE,
+                                        NULL);
+        gimp_int_combo_box_set_active (GIMP_INT_COMBO_BOX (combo), vals->guide);
+        g_signal_connect (combo, "changed",
+                          G_CALLBACK (gimp_int_combo_box_get_active),
+                          &vals->guide);
+        g_signal_connect_swapped (combo, "changed",
+                                  G_CALLBACK (gimp_preview_invalidate),
+                                  preview);
+        gimp_table_attach_aligned (GTK_TABLE (table), 0, row++,
+                                   _("Weight by:"), 0.0, 0.5,
+                                   combo, 2, FALSE);
+    }
+
+    if (gimp_drawable_has_alpha (drawable->drawable_id))
+    {
+        combo = gimp_int_combo_box_new (_("Keep"),          FILTER_ALPHA_KEEP,
+                                        _("Filter"),        FILTER_ALPHA_FILTER,
+                                        _("Premultiplied"), FILTER_ALPHA_PREMULTIPLIED,
+                                        NULL);
+        gimp_int_combo_box_set_active (GIMP_INT_COMBO_BOX (combo), vals->alpha);
+        g_signal_connect (combo, "changed",
+                          G_CALLBACK (gimp_int_combo_box_get_active),
+                          &vals->alpha);
+        g_signal_connect_swapped (combo, "changed",
+                                  G_CALLBACK (gimp_preview_invalidate),
+                                  preview);
+        gimp_table_attach_aligned (GTK_TABLE (table), 0, row++,
+                                   _("Alpha:"), 0.0, 0.5,
+                                   combo, 2, FALSE);
+    }
+
+    /*  The result is the same whatever the thread count, so the preview
+     *  is left alone
+     */
+
+    adj = gimp_scale_entry_new (GTK_TABLE (table), 0, row++,
+                                _("Threads:"), SCALE_WIDTH, SPIN_BUTTON_WIDTH,
+                                vals->num_threads, 0, 64, 1, 4, 0,
+                                TRUE, 0, 0,
+                                _("Worker threads, 0 for one per processor"),
+                                NULL);
+    g_signal_connect (adj, "value_changed",
+                      G_CALLBACK (gimp_int_adjustment_update),
+                      &vals->num_threads);
 
     /*  Image and drawable menus  */
 
@@ -142,8 +272,16 @@ dialog (gint32              image_ID,
             gimp_chain_button_get_active (GIMP_COORDINATES_CHAINBUTTON (coordinates));
         }
     */
+    if (preview_idle_id)
+    {
+        g_source_remove (preview_idle_id);
+        preview_idle_id = 0;
+    }
     gtk_widget_destroy (dlg);
 
+    bilateral_preview_free (preview_state);
+    preview_state = NULL;
+
     return run;
 }
 
@@ -156,3 +294,32 @@ dialog_image_constraint_func (gint32    image_id,
 {
     return (gimp_image_base_type (image_id) == GIMP_RGB);
 }
+
+/*  Stop any preview render, so that the dialog can close straight away  */
+
+static void
+dialog_response (GtkWidget *widget,
+                 gint       response_id,
+                 gpointer   data)
+{
+    bilateral_preview_invalidate (preview_state);
+}
+
+static void
+preview_invalidated (GimpPreview *preview,
+                     gpointer     data)
+{
+    bilateral_preview_invalidate (preview_state);
+
+    if (! preview_idle_id)
+        preview_idle_id = g_idle_add (preview_idle, preview);
+}
+
+static gboolean
+preview_idle (gpointer data)
+{
+    preview_idle_id = 0;
+    bilateral_preview_render (preview_state, GIMP_PREVIEW (data), preview_vals);
+
+    return FALSE;
+}
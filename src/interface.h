@@ -36,7 +36,8 @@ gboolean   dialog (gint32              image_ID,
                    PlugInVals         *vals,
                    PlugInImageVals    *image_vals,
                    PlugInDrawableVals *drawable_vals,
-                   PlugInUIVals       *ui_vals);
+                   PlugInUIVals       *ui_vals,
+                   gboolean            enhance);
 
 
 #endif /* __INTERFACE_H__ */
@@ -35,6 +35,7 @@
 #include "main.h"
 #include "interface.h"
 #include "render.h"
+#include "bilateral.h"
 
 #include "plugin-intl.h"
 
@@ -43,21 +44,26 @@
 /*  Constants  */
 
 #define PROCEDURE_NAME   "simple_bilateral"
+#define ENHANCE_PROCEDURE_NAME "simple_bilateral_enhance"
 
 #define DATA_KEY_VALS    "plug_in_template"
 #define DATA_KEY_UI_VALS "plug_in_template_ui"
+#define DATA_KEY_ENHANCE_VALS "plug_in_template_enhance"
 
 #define PARASITE_KEY     "plug-in-template-options"
 
 
 /*  Local function prototypes  */
 
-static void   query (void);
-static void   run   (const gchar      *name,
-                     gint              nparams,
-                     const GimpParam  *param,
-                     gint             *nreturn_vals,
-                     GimpParam       **return_vals);
+static void   query    (void);
+static void   run      (const gchar      *name,
+                        gint              nparams,
+                        const GimpParam  *param,
+                        gint             *nreturn_vals,
+                        GimpParam       **return_vals);
+static void   get_data (const gchar      *key,
+                        gpointer          data,
+                        gsize             size);
 
 
 /*  Local variables  */
@@ -66,8 +72,14 @@ const PlugInVals default_vals =
 {
     30,
     5,
+    DEFAULT_NUM_BINS,
     DEFAULT_TILE_SIZE,
-    FALSE
+    DEFAULT_NUM_THREADS,
+    FILTER_ENGINE_AUTO,
+    FALSE,
+    1.0,
+    FILTER_GUIDE_NONE,
+    FILTER_ALPHA_KEEP
 };
 
 const PlugInImageVals default_image_vals =
@@ -82,6 +94,7 @@ const PlugInDrawableVals default_drawable_vals =
 
 const PlugInUIVals default_ui_vals =
 {
+    TRUE,
     TRUE
 };
 
@@ -114,6 +127,24 @@ query (void)
         { GIMP_PDB_DRAWABLE, "drawable",   "Input drawable"                  },
         { GIMP_PDB_INT32,    "radius",     "radius"                          },
         { GIMP_PDB_INT32,    "threshold",  "threshold"                       },
+        { GIMP_PDB_INT32,    "bins",       "Histogram bins (8, 16, 32, 64, 128 or 256)" },
+        { GIMP_PDB_INT32,    "guide",      "Filter RGB together, weighted by { NONE (0), LUMA (1), RED (2), GREEN (3), BLUE (4) }" },
+        { GIMP_PDB_INT32,    "alpha",      "Alpha is { KEEP (0), FILTER (1), PREMULTIPLIED (2) }" },
+        { GIMP_PDB_INT32,    "threads",    "Worker threads, 0 for one per processor" },
+    };
+
+    static GimpParamDef enhance_args[] =
+    {
+        { GIMP_PDB_INT32,    "run_mode",   "Interactive, non-interactive"    },
+        { GIMP_PDB_IMAGE,    "image",      "Input image"                     },
+        { GIMP_PDB_DRAWABLE, "drawable",   "Input drawable"                  },
+        { GIMP_PDB_INT32,    "radius",     "radius"                          },
+        { GIMP_PDB_INT32,    "threshold",  "threshold"                       },
+        { GIMP_PDB_FLOAT,    "contrast",   "How far detail is pushed, 0 for none" },
+        { GIMP_PDB_INT32,    "bins",       "Histogram bins (8, 16, 32, 64, 128 or 256)" },
+        { GIMP_PDB_INT32,    "guide",      "Filter RGB together, weighted by { NONE (0), LUMA (1), RED (2), GREEN (3), BLUE (4) }" },
+        { GIMP_PDB_INT32,    "alpha",      "Alpha is { KEEP (0), FILTER (1), PREMULTIPLIED (2) }" },
+        { GIMP_PDB_INT32,    "threads",    "Worker threads, 0 for one per processor" },
     };
 
     gimp_plugin_domain_register (PLUGIN_NAME, LOCALEDIR);
@@ -138,6 +169,22 @@ query (void)
                             args, NULL);
 
     gimp_plugin_menu_register (PROCEDURE_NAME, "<Image>/Filters/Blur/");
+
+    gimp_install_procedure (ENHANCE_PROCEDURE_NAME,
+                            "Enhance detail using a bilateral filter",
+                            "Pushes every pixel away from a bilateral filtered "
+                            "copy of the drawable, then scales the result "
+                            "back into range.",
+                            "David Beynon <dave@spectral3d.co.uk>",
+                            "David Beynon <dave@spectral3d.co.uk>",
+                            "2010",
+                            N_("Bilateral Enhance Details..."),
+                            "RGB*, GRAY*",
+                            GIMP_PLUGIN,
+                            G_N_ELEMENTS (enhance_args), 0,
+                            enhance_args, NULL);
+
+    gimp_plugin_menu_register (ENHANCE_PROCEDURE_NAME, "<Image>/Filters/Enhance/");
 }
 
 static void
@@ -152,6 +199,9 @@ run (const gchar      *name,
     gint32             image_ID;
     GimpRunMode        run_mode;
     GimpPDBStatusType  status = GIMP_PDB_SUCCESS;
+    gboolean           enhance;
+    const gchar       *data_key;
+    gint               n_required;
 
     *nreturn_vals = 1;
     *return_vals  = values;
@@ -173,12 +223,19 @@ run (const gchar      *name,
     drawable_vals = default_drawable_vals;
     ui_vals       = default_ui_vals;
 
-    if (strcmp (name, PROCEDURE_NAME) == 0)
+    enhance  = (strcmp (name, ENHANCE_PROCEDURE_NAME) == 0);
+    data_key = enhance ? DATA_KEY_ENHANCE_VALS : DATA_KEY_VALS;
+
+    if (enhance || strcmp (name, PROCEDURE_NAME) == 0)
     {
         switch (run_mode)
         {
         case GIMP_RUN_NONINTERACTIVE:
-            if (n_params != 8)
+            /*  bins, guide, alpha and threads are optional, for callers
+             *  written against older versions
+             */
+            n_required = enhance ? 6 : 5;
+            if (n_params < n_required || n_params > n_required + 4)
             {
                 status = GIMP_PDB_CALLING_ERROR;
             }
@@ -186,16 +243,29 @@ run (const gchar      *name,
             {
                 vals.radius      = param[3].data.d_int32;
                 vals.threshold   = param[4].data.d_int32;
+                if (enhance)
+                    vals.contrast = param[5].data.d_float;
+                if (n_params > n_required)
+                    vals.num_bins = param[n_required].data.d_int32;
+                if (! filter_bins_supported (vals.num_bins))
+                    status = GIMP_PDB_CALLING_ERROR;
+                if (n_params > n_required + 1)
+                    vals.guide = param[n_required + 1].data.d_int32;
+                if (n_params > n_required + 2)
+                    vals.alpha = param[n_required + 2].data.d_int32;
+                if (n_params > n_required + 3)
+                    vals.num_threads = param[n_required + 3].data.d_int32;
             }
             break;
 
         case GIMP_RUN_INTERACTIVE:
             /*  Possibly retrieve data  */
-            gimp_get_data (DATA_KEY_VALS,    &vals);
-            gimp_get_data (DATA_KEY_UI_VALS, &ui_vals);
+            get_data (data_key,         &vals,    sizeof (vals));
+            get_data (DATA_KEY_UI_VALS, &ui_vals, sizeof (ui_vals));
 
             if (! dialog (image_ID, drawable,
-                          &vals, &image_vals, &drawable_vals, &ui_vals))
+                          &vals, &image_vals, &drawable_vals, &ui_vals,
+                          enhance))
             {
                 status = GIMP_PDB_CANCEL;
             }
@@ -203,7 +273,7 @@ run (const gchar      *name,
 
         case GIMP_RUN_WITH_LAST_VALS:
             /*  Possibly retrieve data  */
-            gimp_get_data (DATA_KEY_VALS, &vals);
+            get_data (data_key, &vals, sizeof (vals));
             break;
 
         default:
@@ -217,14 +287,17 @@ run (const gchar      *name,
 
     if (status == GIMP_PDB_SUCCESS)
     {
-        render (image_ID, drawable, &vals, &image_vals, &drawable_vals);
+        if (enhance)
+            render_enhance (image_ID, drawable, &vals, &image_vals, &drawable_vals);
+        else
+            render (image_ID, drawable, &vals, &image_vals, &drawable_vals);
 
         if (run_mode != GIMP_RUN_NONINTERACTIVE)
             gimp_displays_flush ();
 
         if (run_mode == GIMP_RUN_INTERACTIVE)
         {
-            gimp_set_data (DATA_KEY_VALS,    &vals,    sizeof (vals));
+            gimp_set_data (data_key,         &vals,    sizeof (vals));
             gimp_set_data (DATA_KEY_UI_VALS, &ui_vals, sizeof (ui_vals));
         }
 
@@ -234,3 +307,15 @@ run (const gchar      *name,
     values[0].type = GIMP_PDB_STATUS;
     values[0].data.d_status = status;
 }
+
+/*  Values saved by a version with another layout would be read as garbage,
+ *  so anything that is not the size expected is left for the defaults.
+ */
+static void
+get_data (const gchar *key,
+          gpointer     data,
+          gsize        size)
+{
+    if (gimp_get_data_size (key) == (gint) size)
+        gimp_get_data (key, data);
+}
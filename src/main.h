@@ -33,8 +33,14 @@ typedef struct
 {
     gint      threshold;
     gint      radius;
+    gint      num_bins;
     gint      tile_size;
+    gint      num_threads;
+    gint      engine;
     gboolean     linear;
+    gdouble   contrast;
+    gint      guide;
+    gint      alpha;
 } PlugInVals;
 
 typedef struct
@@ -50,6 +56,7 @@ typedef struct
 typedef struct
 {
     gboolean  chain_active;
+    gboolean  preview;
 } PlugInUIVals;
 
 
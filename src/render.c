@@ -47,5 +47,22 @@ render (gint32              image_ID,
         PlugInDrawableVals *drawable_vals)
 {
 
-    bilateral_filter(vals->radius, vals->threshold, vals->tile_size, vals->linear, image_ID, drawable);
+    bilateral_filter(vals->radius, vals->threshold, vals->num_bins, vals->tile_size,
+                     vals->num_threads, (filter_engine)vals->engine,
+                     (filter_guide)vals->guide, (filter_alpha)vals->alpha,
+                     vals->linear, image_ID, drawable);
+}
+
+void
+render_enhance (gint32              image_ID,
+                GimpDrawable       *drawable,
+                PlugInVals         *vals,
+                PlugInImageVals    *image_vals,
+                PlugInDrawableVals *drawable_vals)
+{
+
+    bilateral_enhance(vals->radius, vals->threshold, vals->num_bins, vals->contrast,
+                      vals->tile_size, vals->num_threads, (filter_engine)vals->engine,
+                      (filter_guide)vals->guide, (filter_alpha)vals->alpha,
+                      vals->linear, image_ID, drawable);
 }
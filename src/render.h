@@ -37,5 +37,11 @@ void   render (gint32              image_ID,
                PlugInImageVals    *image_vals,
                PlugInDrawableVals *drawable_vals);
 
+void   render_enhance (gint32              image_ID,
+                       GimpDrawable       *drawable,
+                       PlugInVals         *vals,
+                       PlugInImageVals    *image_vals,
+                       PlugInDrawableVals *drawable_vals);
+
 
 #endif /* __RENDER_H__ */
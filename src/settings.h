@@ -1,34 +1,100 @@
 #ifndef __SETTINGS_H__
 #define __SETTINGS_H__
 
-/* the default tile size MUST be at least 2x the max filter radius */
-#define DEFAULT_TILE_SIZE 512
+/* the integral engine builds a histogram for each tile, plus a border of the
+ * filter radius around it.  By default (a tile size of 0) tiles are made as
+ * big as TILE_MEMORY_BYTES allows once it is shared between the worker
+ * threads, up to TILE_WORKER_BYTES each, past which bigger tiles usually lose
+ * more to cache misses and page faults than they save on overlap.  Windows
+ * too big for that go to the sliding engine, unless the integral engine is
+ * asked for, when they get bigger tiles.  A tile size above
+ * 0 asks for square histograms of that size instead, and must be more than
+ * 2x the filter radius, or the sliding engine is used.
+ */
+#define DEFAULT_TILE_SIZE 0
+#define TILE_MEMORY_BYTES (256 * 1024 * 1024)
+#define TILE_WORKER_BYTES (32 * 1024 * 1024)
+
+/* number of worker threads used to filter tiles.  0 means one per online
+ * processor.  Each thread holds its own histogram buffer, so memory use grows
+ * with the thread count.
+ */
+#define DEFAULT_NUM_THREADS 0
+
+/* the sliding histogram engine works on full width strips of this many rows.
+ * It is picked automatically once the border around a tile is at least
+ * 1/SLIDING_OVERLAP_RATIO of the histogram built for it, or for images of at
+ * least SLIDING_MIN_PIXELS pixels.
+ */
+#define SLIDING_STRIP_HEIGHT 128
+#define SLIDING_OVERLAP_RATIO 4
+#define SLIDING_MIN_PIXELS (4 * 1024 * 1024)
+
+/* images that big stay on the integral engine if at least 1/NARROW_TILE_RATIO
+ * of their tiles are flat or hold values spanning at most 1/NARROW_SPAN_RATIO
+ * of the bins, as it skips those tiles or builds only the bins they use.
+ * Only every NARROW_SCAN_STEP'th row is read to find out, to keep it quick.
+ */
+#define NARROW_TILE_RATIO 2
+#define NARROW_SPAN_RATIO 4
+#define NARROW_SCAN_STEP 8
+
+/* the streaming engine keeps only the 2r+2 integral histogram rows that the
+ * current output row needs, and builds each row just before it is used.  Bands
+ * are made narrow enough for those rows to fit in STREAMING_RING_BYTES.  It is
+ * only used when asked for.
+ */
+#define STREAMING_RING_BYTES (1024 * 1024)
+#define STREAMING_MIN_WIDTH 64
+#define STREAMING_BAND_HEIGHT 256
+
+/* the integral engine stores its histograms bin major, in planes of 8 bins,
+ * when the bins within the threshold of any value span at most
+ * 1/SLAB_LAYOUT_RATIO of them, so that each pixel only reads the planes it
+ * weighs.  Otherwise each entry holds all its bins side by side.
+ */
+#define SLAB_LAYOUT_RATIO 4
+
+/* integral histograms of at least HUGE_PAGE_BYTES are aligned to it and
+ * madvise()d for transparent huge pages, where the system has them, to save
+ * on TLB misses and page faults.  0 turns this off.
+ */
+#define HUGE_PAGE_BYTES (2 * 1024 * 1024)
+
+/* integral histogram buffers that are no longer in use are kept, up to
+ * HISTOGRAM_ARENA_BYTES, for the next histograms of the same run to reuse,
+ * so that replaced cache entries do not fault in fresh memory.  They are
+ * handed back at the end of each run.
+ */
+#define HISTOGRAM_ARENA_BYTES (256 * 1024 * 1024)
+
+/* memory allowed for integral histograms kept between runs over the same
+ * pixels, so that changing only the threshold skips building them again.
+ * A cache makes auto mode pick the integral engine, with tiles held to
+ * TILE_WORKER_BYTES so that each fits, so keep this at least that big.
+ */
+#define HISTOGRAM_CACHE_BYTES (256 * 1024 * 1024)
+
+/* the dialog's preview first shows a quick pass, shrunk to at most
+ * PREVIEW_QUICK_PIXELS pixels and using at most PREVIEW_QUICK_BINS bins, while
+ * the full quality one is worked out.
+ */
+#define PREVIEW_QUICK_PIXELS (128 * 1024)
+#define PREVIEW_QUICK_BINS 16
 
 /* with a tile size of 512 the number of bins in use = the number of mb
- * required to store a tile.  The more bins you have then the more accuratte
+ * required to store a tile (half that for radii up to 127, where 16 bit
+ * histograms are used).  Automatic tiles shrink as bins are added to stay
+ * within TILE_MEMORY_BYTES.  The more bins you have then the more accuratte
  * the result will be, up to a maximum of 256 bins.
  *
  * 64 is the mimimum number to give consistently good results.
  * 32 bins and below will result in noticeable banding artifacts.
+ *
+ * The bin count can be chosen at run time, and may be 8, 16, 32, 64, 128 or
+ * 256.  This is the default.
  */
 
-#define USE_64_BINS
-
-#if(defined(USE_8_BINS))
-#define NUM_BINS 8
-#define BIN_SIZE 32
-#elif(defined(USE_32_BINS))
-#define NUM_BINS 32
-#define BIN_SIZE 8
-#elif(defined(USE_64_BINS))
-#define NUM_BINS 64
-#define BIN_SIZE 4
-#elif(defined(USE_128_BINS))
-#define NUM_BINS 128
-#define BIN_SIZE 2
-#elif(defined(USE_256_BINS))
-#define NUM_BINS 265
-#define BIN_SIZE 1
-#endif
+#define DEFAULT_NUM_BINS 64
 
 #endif
@@ -0,0 +1,12 @@
+#ifndef __SIMD_H__
+#define __SIMD_H__
+
+// SIMD kernels are written with gcc target attributes and picked at runtime,
+// so they are only available on x86 with a gcc compatible compiler.  Other
+// builds use the plain C++ versions.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+#endif
@@ -0,0 +1,182 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include "stats.h"
+
+bool g_stats_enabled(false);
+
+typedef struct _stats_totals
+{
+    double wall[STATS_NUM_STAGES], cpu[STATS_NUM_STAGES];
+    uint64_t count[STATS_NUM_STAGES];
+} stats_totals;
+
+static pthread_mutex_t g_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static stats_totals g_totals;
+static const char *g_engine("");
+static uint32_t g_workers(0), g_jobs(0);
+
+static ptrdiff_t g_memory[STATS_NUM_MEMORY], g_memory_peak[STATS_NUM_MEMORY];
+static long g_minor_faults(0);
+
+// Each thread adds up its own times, so that timing needs no locking.
+static __thread stats_totals t_totals;
+
+static const char *stage_names[STATS_NUM_STAGES] =
+{
+    "read", "build", "filter", "enhance", "write"
+};
+
+static const char *memory_names[STATS_NUM_MEMORY] =
+{
+    "image", "histogram"
+};
+
+// Pages the kernel had to map in, for the whole process.
+static long get_minor_faults(void)
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt;
+}
+
+static double get_time(clockid_t clock)
+{
+    struct timespec t;
+
+    clock_gettime(clock, &t);
+    return t.tv_sec + (t.tv_nsec * 1e-9);
+}
+
+void stats_reset(void)
+{
+    pthread_mutex_lock(&g_stats_mutex);
+    g_stats_enabled = getenv("SIMPLE_BILATERAL_STATS") != NULL;
+    memset(&g_totals, 0, sizeof(g_totals));
+    memset(&t_totals, 0, sizeof(t_totals));
+    g_engine = "";
+    g_workers = g_jobs = 0;
+    g_minor_faults = get_minor_faults();
+    for(uint32_t i=0; i<STATS_NUM_MEMORY; i++)
+    {
+        __sync_lock_test_and_set(&g_memory_peak[i], g_memory[i]);
+    }
+    pthread_mutex_unlock(&g_stats_mutex);
+}
+
+void stats_begin_timer(stats_timer &timer)
+{
+    timer.wall = get_time(CLOCK_MONOTONIC);
+    timer.cpu = get_time(CLOCK_THREAD_CPUTIME_ID);
+}
+
+void stats_lap_timer(stats_timer &timer, stats_stage stage)
+{
+    double wall = get_time(CLOCK_MONOTONIC);
+    double cpu = get_time(CLOCK_THREAD_CPUTIME_ID);
+
+    t_totals.wall[stage]+= wall - timer.wall;
+    t_totals.cpu[stage]+= cpu - timer.cpu;
+    t_totals.count[stage]++;
+
+    timer.wall = wall;
+    timer.cpu = cpu;
+}
+
+void stats_flush_thread(void)
+{
+    pthread_mutex_lock(&g_stats_mutex);
+    for(uint32_t i=0; i<STATS_NUM_STAGES; i++)
+    {
+        g_totals.wall[i]+= t_totals.wall[i];
+        g_totals.cpu[i]+= t_totals.cpu[i];
+        g_totals.count[i]+= t_totals.count[i];
+    }
+    memset(&t_totals, 0, sizeof(t_totals));
+    pthread_mutex_unlock(&g_stats_mutex);
+}
+
+void stats_set_run(const char *engine, uint32_t workers, uint32_t jobs)
+{
+    pthread_mutex_lock(&g_stats_mutex);
+    g_engine = engine;
+    g_workers = workers;
+    g_jobs+= jobs;
+    pthread_mutex_unlock(&g_stats_mutex);
+}
+
+void stats_track_memory(stats_memory kind, ptrdiff_t bytes)
+{
+    ptrdiff_t held = __sync_add_and_fetch(&g_memory[kind], bytes);
+
+    for(;;)
+    {
+        ptrdiff_t peak = g_memory_peak[kind];
+
+        if((held <= peak) ||
+                __sync_bool_compare_and_swap(&g_memory_peak[kind], peak, held))
+        {
+            break;
+        }
+    }
+}
+
+void stats_report(const char *name,
+                  uint32_t width, uint32_t height, uint32_t channels,
+                  uint32_t radius, uint32_t num_bins)
+{
+    const char *dest;
+    FILE *f;
+
+    if(!g_stats_enabled)
+    {
+        return;
+    }
+    stats_flush_thread();
+
+    dest = getenv("SIMPLE_BILATERAL_STATS");
+    if(!dest || !strcmp(dest, "1") || !dest[0])
+    {
+        f = stderr;
+    }
+    else
+    {
+        f = fopen(dest, "a");
+        if(!f)
+        {
+            return;
+        }
+    }
+
+    pthread_mutex_lock(&g_stats_mutex);
+    fprintf(f, "{\"name\":\"%s\",\"width\":%u,\"height\":%u,\"channels\":%u,"
+            "\"radius\":%u,\"bins\":%u,\"engine\":\"%s\",\"workers\":%u,"
+            "\"jobs\":%u,\"stages\":{",
+            name, width, height, channels, radius, num_bins,
+            g_engine, g_workers, g_jobs);
+    for(uint32_t i=0; i<STATS_NUM_STAGES; i++)
+    {
+        fprintf(f, "%s\"%s\":{\"wall\":%.6f,\"cpu\":%.6f,\"count\":%lu}",
+                i ? "," : "", stage_names[i],
+                g_totals.wall[i], g_totals.cpu[i],
+                (unsigned long)g_totals.count[i]);
+    }
+    fprintf(f, "},\"peak_bytes\":{");
+    for(uint32_t i=0; i<STATS_NUM_MEMORY; i++)
+    {
+        fprintf(f, "%s\"%s\":%ld", i ? "," : "", memory_names[i],
+                (long)g_memory_peak[i]);
+    }
+    fprintf(f, "},\"minor_faults\":%ld}\n", get_minor_faults() - g_minor_faults);
+    pthread_mutex_unlock(&g_stats_mutex);
+
+    if(f != stderr)
+    {
+        fclose(f);
+    }
+}
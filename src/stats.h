@@ -0,0 +1,77 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+#include <stdint.h>
+#include <stddef.h>
+
+// Run statistics: wall and cpu time per stage, job counts, the peak memory
+// held by image and histogram buffers, and the minor page faults taken.
+// Timing is only done while stats are enabled, which stats_reset turns on
+// when the SIMPLE_BILATERAL_STATS environment variable is set.  A value of
+// "1" sends the report to stderr, anything else is taken as a file to append
+// it to.
+
+typedef enum
+{
+    STATS_READ,         // reading the source
+    STATS_BUILD,        // building histograms
+    STATS_FILTER,       // filtering pixels from window histograms
+    STATS_ENHANCE,      // detail enhancement
+    STATS_WRITE,        // writing the result back
+    STATS_NUM_STAGES
+} stats_stage;
+
+typedef enum
+{
+    STATS_MEMORY_IMAGE,
+    STATS_MEMORY_HISTOGRAM,
+    STATS_NUM_MEMORY
+} stats_memory;
+
+extern bool g_stats_enabled;
+
+// Start collecting stats for a new invocation.
+void stats_reset(void);
+
+// Time a stretch of work on the calling thread.  stats_lap charges the time
+// since stats_begin or the last lap to stage, and starts timing again.
+typedef struct _stats_timer
+{
+    double wall, cpu;
+} stats_timer;
+
+void stats_begin_timer(stats_timer &timer);
+void stats_lap_timer(stats_timer &timer, stats_stage stage);
+
+inline void stats_begin(stats_timer &timer)
+{
+    if(g_stats_enabled)
+    {
+        stats_begin_timer(timer);
+    }
+}
+
+inline void stats_lap(stats_timer &timer, stats_stage stage)
+{
+    if(g_stats_enabled)
+    {
+        stats_lap_timer(timer, stage);
+    }
+}
+
+// Times are gathered per thread, and must be flushed into the totals by each
+// worker before it exits.
+void stats_flush_thread(void);
+
+// Record how the filter was run.
+void stats_set_run(const char *engine, uint32_t workers, uint32_t jobs);
+
+// Track buffer allocations.  These are counted whether or not stats are
+// enabled, so that peaks are right whenever a report is made.
+void stats_track_memory(stats_memory kind, ptrdiff_t bytes);
+
+// Write one report, as a single line of JSON, if stats are enabled.
+void stats_report(const char *name,
+                  uint32_t width, uint32_t height, uint32_t channels,
+                  uint32_t radius, uint32_t num_bins);
+
+#endif